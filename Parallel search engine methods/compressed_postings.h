@@ -0,0 +1,476 @@
+#pragma once
+#include "posting_list.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define COMPRESSED_POSTINGS_HAVE_AVX2 1
+#endif
+
+// Unpacks count values of BitWidth bits each. The width is a compile-time constant,
+// so the shifts and masks are fixed. This scalar version runs everywhere and unpacks
+// the tail that the vector version leaves over.
+// Packed data is followed by one spare word, so reading a word pair never runs out of bounds
+template <unsigned BitWidth>
+void UnpackBits(const uint32_t* packed, size_t count, uint32_t* values) {
+    if constexpr (BitWidth == 0) {
+        std::fill(values, values + count, 0u);
+    } else {
+        constexpr uint64_t mask = (uint64_t{1} << BitWidth) - 1;
+        for (size_t i = 0; i < count; ++i) {
+            const size_t bit = i * BitWidth;
+            const uint64_t pair = packed[bit / 32] | (uint64_t{packed[bit / 32 + 1]} << 32);
+            values[i] = static_cast<uint32_t>((pair >> (bit % 32)) & mask);
+        }
+    }
+}
+
+using UnpackFunction = void (*)(const uint32_t*, size_t, uint32_t*);
+
+template <size_t... BitWidths>
+constexpr std::array<UnpackFunction, sizeof...(BitWidths)> MakeUnpackTable(std::index_sequence<BitWidths...>) {
+    return {&UnpackBits<BitWidths>...};
+}
+
+#ifdef COMPRESSED_POSTINGS_HAVE_AVX2
+
+// Thirty-two values take BitWidth words, so every group of them starts on a word boundary and
+// its values lie at the same words and shifts. Each lane gathers the word pair its value lies
+// in, which reads no further than the scalar version does
+constexpr size_t UNPACK_GROUP_SIZE = 32;
+
+template <unsigned BitWidth>
+__attribute__((target("avx2"))) void UnpackBitsAvx2(const uint32_t* packed, size_t count, uint32_t* values) {
+    if constexpr (BitWidth == 0) {
+        UnpackBits<0>(packed, count, values);
+    } else {
+        __m256i low_words[UNPACK_GROUP_SIZE / 8];
+        __m256i shifts[UNPACK_GROUP_SIZE / 8];
+        __m256i high_shifts[UNPACK_GROUP_SIZE / 8];
+        for (size_t part = 0; part < UNPACK_GROUP_SIZE / 8; ++part) {
+            const __m256i lanes = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(static_cast<int>(part * 8)));
+            const __m256i bits = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(BitWidth));
+            low_words[part] = _mm256_srli_epi32(bits, 5);
+            shifts[part] = _mm256_and_si256(bits, _mm256_set1_epi32(31));
+            // Shifting by 32 gives zero, so a value that starts a word takes nothing from the next
+            high_shifts[part] = _mm256_sub_epi32(_mm256_set1_epi32(32), shifts[part]);
+        }
+        const __m256i mask = _mm256_set1_epi32(static_cast<int>((uint64_t{1} << BitWidth) - 1));
+        const __m256i one = _mm256_set1_epi32(1);
+        size_t i = 0;
+        for (; i + UNPACK_GROUP_SIZE <= count; i += UNPACK_GROUP_SIZE, packed += BitWidth) {
+            const int* words = reinterpret_cast<const int*>(packed);
+            for (size_t part = 0; part < UNPACK_GROUP_SIZE / 8; ++part) {
+                const __m256i low = _mm256_i32gather_epi32(words, low_words[part], 4);
+                const __m256i high = _mm256_i32gather_epi32(words, _mm256_add_epi32(low_words[part], one), 4);
+                const __m256i value = _mm256_or_si256(_mm256_srlv_epi32(low, shifts[part]), _mm256_sllv_epi32(high, high_shifts[part]));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i + part * 8), _mm256_and_si256(value, mask));
+            }
+        }
+        UnpackBits<BitWidth>(packed, count - i, values + i);
+    }
+}
+
+template <size_t... BitWidths>
+constexpr std::array<UnpackFunction, sizeof...(BitWidths)> MakeAvx2UnpackTable(std::index_sequence<BitWidths...>) {
+    return {&UnpackBitsAvx2<BitWidths>...};
+}
+
+#endif
+
+// Unpack functions by bit width, chosen once for the CPU the program runs on
+inline const std::array<UnpackFunction, 33>& GetUnpackFunctions() {
+    static const std::array<UnpackFunction, 33> functions = [] {
+#ifdef COMPRESSED_POSTINGS_HAVE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return MakeAvx2UnpackTable(std::make_index_sequence<33>{});
+        }
+#endif
+        return MakeUnpackTable(std::make_index_sequence<33>{});
+    }();
+    return functions;
+}
+
+// Posting list that stores document indexes as deltas and term counts, both bit-packed
+// in blocks of up to BLOCK_SIZE postings. Indexes must be added in increasing order; the
+// last block may be short, and adding to it packs it again.
+// Every block also keeps an upper bound of its term frequencies, which removals may leave loose
+class CompressedPostingList {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+
+private:
+    struct DecodedBlock {
+        std::array<uint32_t, BLOCK_SIZE> indexes;
+        std::array<uint32_t, BLOCK_SIZE> counts;
+    };
+
+public:
+    // Walks the postings in order, moving only forward and decoding one block at a time
+    class Cursor {
+    public:
+        explicit Cursor(const CompressedPostingList& postings)
+            : postings_(&postings) {
+            if (!postings_->blocks_.empty()) {
+                postings_->Decode(postings_->blocks_[0], decoded_);
+            }
+        }
+
+        DocumentIndex Document() const {
+            return block_ < postings_->blocks_.size() ? decoded_.indexes[position_] : END_OF_POSTINGS;
+        }
+
+        uint32_t TermCount() const {
+            return decoded_.counts[position_];
+        }
+
+        // Moves to the first posting whose document is not less than target
+        void Seek(DocumentIndex target) {
+            if (Document() >= target) {
+                return;
+            }
+            const auto& blocks = postings_->blocks_;
+            if (target > blocks[block_].last_index) {
+                block_ = postings_->FindBlock(block_ + 1, target) - blocks.begin();
+                if (block_ == blocks.size()) {
+                    return;
+                }
+                postings_->Decode(blocks[block_], decoded_);
+                position_ = 0;
+            }
+            position_ = std::lower_bound(decoded_.indexes.begin() + position_, decoded_.indexes.begin() + blocks[block_].size, target)
+                        - decoded_.indexes.begin();
+        }
+
+        void Next() {
+            const auto& blocks = postings_->blocks_;
+            if (++position_ == blocks[block_].size) {
+                position_ = 0;
+                if (++block_ < blocks.size()) {
+                    postings_->Decode(blocks[block_], decoded_);
+                }
+            }
+        }
+
+        double GetMaxTermFreq() const {
+            return postings_->max_term_freq_;
+        }
+
+        // Bound of the block that holds the first posting not less than target
+        BlockBound GetBlockBound(DocumentIndex target) const {
+            const auto& blocks = postings_->blocks_;
+            const auto block = postings_->FindBlock(std::min(block_, blocks.size()), target);
+            if (block == blocks.end()) {
+                return {END_OF_POSTINGS, 0.0};
+            }
+            return {block->last_index, postings_->block_max_term_freqs_[block - blocks.begin()]};
+        }
+
+    private:
+        const CompressedPostingList* postings_;
+        // Equal to the number of blocks once the postings run out
+        size_t block_ = 0;
+        size_t position_ = 0;
+        DecodedBlock decoded_;
+    };
+
+    // term_freq only feeds the upper bounds; the list itself stores term_count.
+    // Everything is allocated first, so a list that fails to grow stays as it was
+    void Add(uint32_t document_index, uint32_t term_count, double term_freq) {
+        blocks_.reserve(blocks_.size() + 1);
+        block_max_term_freqs_.reserve(blocks_.size() + 1);
+        words_.reserve(words_.size() + 1);
+        std::vector<uint32_t> packed;
+        if (blocks_.empty() || blocks_.back().size == BLOCK_SIZE) {
+            const size_t offset = GetPackedSize();
+            const Block block = PackBlock(&document_index, &term_count, 1, offset, packed);
+            words_.reserve(offset + packed.size() + 1);
+            blocks_.push_back(block);
+            block_max_term_freqs_.push_back(term_freq);
+            ReplaceWords(offset, 0, packed);
+        } else if (TryAppend(document_index, term_count)) {
+            const size_t last = blocks_.size() - 1;
+            block_max_term_freqs_.Mutable()[last] = std::max(block_max_term_freqs_[last], term_freq);
+        } else {
+            const size_t last = blocks_.size() - 1;
+            const Block old_block = blocks_[last];
+            DecodedBlock decoded;
+            Decode(old_block, decoded);
+            decoded.indexes[old_block.size] = document_index;
+            decoded.counts[old_block.size] = term_count;
+            const Block block = PackBlock(decoded.indexes.data(), decoded.counts.data(), old_block.size + 1, old_block.offset, packed);
+            words_.reserve(words_.size() + packed.size());
+            blocks_.Mutable()[last] = block;
+            block_max_term_freqs_.Mutable()[last] = std::max(block_max_term_freqs_[last], term_freq);
+            ReplaceWords(old_block.offset, GetPackedLength(old_block), packed);
+        }
+        max_term_freq_ = std::max(max_term_freq_, term_freq);
+        ++size_;
+    }
+
+    // Returns the term count of the document, or 0 if the list does not contain it
+    uint32_t FindTermCount(uint32_t document_index) const {
+        const auto block = FindBlock(document_index);
+        if (block == blocks_.end() || block->first_index > document_index) {
+            return 0;
+        }
+        DecodedBlock decoded;
+        Decode(*block, decoded);
+        const auto it = std::lower_bound(decoded.indexes.begin(), decoded.indexes.begin() + block->size, document_index);
+        return *it == document_index ? decoded.counts[it - decoded.indexes.begin()] : 0;
+    }
+
+    void Remove(uint32_t document_index) {
+        const auto block = FindBlock(document_index);
+        if (block == blocks_.end()) {
+            return;
+        }
+        const Block old_block = *block;
+        DecodedBlock decoded;
+        Decode(old_block, decoded);
+        const auto it = std::lower_bound(decoded.indexes.begin(), decoded.indexes.begin() + old_block.size, document_index);
+        if (*it != document_index) {
+            return;
+        }
+        const size_t position = it - decoded.indexes.begin();
+        const size_t new_size = old_block.size - 1;
+        std::copy(decoded.indexes.begin() + position + 1, decoded.indexes.begin() + old_block.size, decoded.indexes.begin() + position);
+        std::copy(decoded.counts.begin() + position + 1, decoded.counts.begin() + old_block.size, decoded.counts.begin() + position);
+        --size_;
+
+        // Repack the block in place and shift the packed data of the blocks after it
+        std::vector<uint32_t> repacked;
+        const size_t old_length = GetPackedLength(old_block);
+        const size_t block_position = block - blocks_.begin();
+        if (new_size == 0) {
+            blocks_.erase(block_position, block_position + 1);
+            block_max_term_freqs_.erase(block_position, block_position + 1);
+        } else {
+            blocks_.Mutable()[block_position] = PackBlock(decoded.indexes.data(), decoded.counts.data(), new_size, old_block.offset, repacked);
+        }
+        ReplaceWords(old_block.offset, old_length, repacked);
+        Block* blocks = blocks_.Mutable();
+        for (size_t next = block_position + (new_size == 0 ? 0 : 1); next < blocks_.size(); ++next) {
+            blocks[next].offset = static_cast<uint32_t>(blocks[next].offset - old_length + repacked.size());
+        }
+    }
+
+    // Maps every document index through new_indexes, which must keep their order.
+    // The blocks keep their postings and bounds and are only packed again
+    void Renumber(const std::vector<DocumentIndex>& new_indexes) {
+        std::vector<uint32_t> packed;
+        Block* blocks = blocks_.Mutable();
+        DecodedBlock decoded;
+        for (size_t block = 0; block < blocks_.size(); ++block) {
+            Decode(blocks[block], decoded);
+            for (size_t i = 0; i < blocks[block].size; ++i) {
+                decoded.indexes[i] = new_indexes[decoded.indexes[i]];
+            }
+            blocks[block] = PackBlock(decoded.indexes.data(), decoded.counts.data(), blocks[block].size, packed.size(), packed);
+        }
+        words_.clear();
+        ReplaceWords(0, 0, packed);
+    }
+
+    // Calls action(document_index, term_count) in increasing order of document_index
+    template <typename Action>
+    void ForEach(Action action) const {
+        DecodedBlock decoded;
+        for (const Block& block : blocks_) {
+            Decode(block, decoded);
+            for (size_t i = 0; i < block.size; ++i) {
+                action(decoded.indexes[i], decoded.counts[i]);
+            }
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    void Save(SnapshotWriter& writer) const {
+        writer.WriteArray(blocks_);
+        writer.WriteArray(block_max_term_freqs_);
+        writer.WriteArray(words_);
+        writer.Write(max_term_freq_);
+        writer.Write(static_cast<uint64_t>(size_));
+    }
+
+    // Packed blocks are read from the mapping until the list is first changed
+    static CompressedPostingList Open(SnapshotReader& reader) {
+        CompressedPostingList postings;
+        postings.blocks_ = reader.ReadArray<Block>();
+        postings.block_max_term_freqs_ = reader.ReadArray<double>();
+        postings.words_ = reader.ReadArray<uint32_t>();
+        postings.max_term_freq_ = reader.Read<double>();
+        postings.size_ = reader.Read<uint64_t>();
+        size_t packed_size = 0;
+        size_t size = 0;
+        for (const Block& block : postings.blocks_) {
+            if (block.size == 0 || block.size > BLOCK_SIZE || block.delta_bits > 32 || block.count_bits > 32
+                || block.offset != packed_size) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+            packed_size += GetPackedLength(block);
+            size += block.size;
+        }
+        if (postings.words_.size() != (packed_size > 0 ? packed_size + 1 : 0) || size != postings.size_
+            || postings.block_max_term_freqs_.size() != postings.blocks_.size()) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        return postings;
+    }
+
+private:
+    struct Block {
+        uint32_t first_index;
+        uint32_t last_index;
+        // Position of the packed deltas in words_; the packed term counts follow them
+        uint32_t offset;
+        uint8_t size;
+        uint8_t delta_bits;
+        uint8_t count_bits;
+        uint8_t reserved;
+    };
+
+    MappedArray<Block> blocks_;
+    MappedArray<double> block_max_term_freqs_;
+    // Packed runs of all blocks back to back, then the spare word if there are any
+    MappedArray<uint32_t> words_;
+    double max_term_freq_ = 0.0;
+    size_t size_ = 0;
+
+    static unsigned GetBitWidth(uint32_t max_value) {
+        unsigned bits = 0;
+        while (bits < 32 && (max_value >> bits) != 0) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    // Runs of zero-bit values take no words at all
+    static size_t GetPackedLength(size_t count, unsigned bits) {
+        return (count * bits + 31) / 32;
+    }
+
+    static size_t GetPackedLength(const Block& block) {
+        return GetPackedLength(block.size, block.delta_bits) + GetPackedLength(block.size, block.count_bits);
+    }
+
+    size_t GetPackedSize() const {
+        return words_.empty() ? 0 : words_.size() - 1;
+    }
+
+    // Puts packed in place of old_length words at offset and keeps the spare word at the end
+    void ReplaceWords(size_t offset, size_t old_length, const std::vector<uint32_t>& packed) {
+        const size_t packed_size = GetPackedSize() - old_length + packed.size();
+        if (old_length > 0) {
+            words_.erase(offset, offset + old_length);
+        }
+        if (!packed.empty()) {
+            words_.insert(offset, packed.data(), packed.data() + packed.size());
+        }
+        if (packed_size == 0) {
+            words_.clear();
+        } else {
+            words_.resize(packed_size + 1);
+        }
+    }
+
+    // Appends to the short last block in place, which works while the new posting fits the bit
+    // widths of the block and the packed deltas keep their length, so the term counts stay put
+    bool TryAppend(uint32_t document_index, uint32_t term_count) {
+        const Block& block = blocks_.back();
+        const uint32_t delta = document_index - block.last_index;
+        const uint32_t count_code = term_count - 1;
+        const size_t delta_length = GetPackedLength(block.size, block.delta_bits);
+        if (GetBitWidth(delta) > block.delta_bits || GetBitWidth(count_code) > block.count_bits
+            || GetPackedLength(block.size + 1, block.delta_bits) != delta_length) {
+            return false;
+        }
+        if (GetPackedLength(block.size + 1, block.count_bits) > GetPackedLength(block.size, block.count_bits)) {
+            // The spare word becomes the last word of the counts
+            words_.push_back(0);
+        }
+        uint32_t* words = words_.Mutable() + block.offset;
+        SetBits(words, block.size * block.delta_bits, delta);
+        SetBits(words + delta_length, block.size * block.count_bits, count_code);
+        Block& changed_block = blocks_.Mutable()[blocks_.size() - 1];
+        changed_block.last_index = document_index;
+        ++changed_block.size;
+        return true;
+    }
+
+    // The bits must be zero so far. Only a value that crosses a word boundary touches the next word
+    static void SetBits(uint32_t* words, size_t bit, uint32_t value) {
+        const uint64_t shifted = uint64_t{value} << (bit % 32);
+        words[bit / 32] |= static_cast<uint32_t>(shifted);
+        if ((shifted >> 32) != 0) {
+            words[bit / 32 + 1] |= static_cast<uint32_t>(shifted >> 32);
+        }
+    }
+
+    static void PackBits(const uint32_t* values, size_t count, unsigned bits, std::vector<uint32_t>& words) {
+        const size_t start = words.size();
+        const size_t length = GetPackedLength(count, bits);
+        // The last value may spill zero bits into the word after the run
+        words.resize(start + length + 1, 0);
+        for (size_t i = 0; i < count && bits > 0; ++i) {
+            const size_t bit = i * bits;
+            const uint64_t shifted = uint64_t{values[i]} << (bit % 32);
+            words[start + bit / 32] |= static_cast<uint32_t>(shifted);
+            words[start + bit / 32 + 1] |= static_cast<uint32_t>(shifted >> 32);
+        }
+        words.resize(start + length);
+    }
+
+    // Stores the gaps between consecutive indexes (the first gap is 0) and term counts minus one.
+    // offset is where the packed data is going to lie in words_
+    static Block PackBlock(const uint32_t* indexes, const uint32_t* counts, size_t size, size_t offset, std::vector<uint32_t>& words) {
+        std::array<uint32_t, BLOCK_SIZE> deltas;
+        std::array<uint32_t, BLOCK_SIZE> count_codes;
+        uint32_t max_delta = 0;
+        uint32_t max_count_code = 0;
+        for (size_t i = 0; i < size; ++i) {
+            deltas[i] = i == 0 ? 0 : indexes[i] - indexes[i - 1];
+            count_codes[i] = counts[i] - 1;
+            max_delta = std::max(max_delta, deltas[i]);
+            max_count_code = std::max(max_count_code, count_codes[i]);
+        }
+        Block block{indexes[0], indexes[size - 1], static_cast<uint32_t>(offset), static_cast<uint8_t>(size),
+                    static_cast<uint8_t>(GetBitWidth(max_delta)), static_cast<uint8_t>(GetBitWidth(max_count_code)), 0};
+        PackBits(deltas.data(), size, block.delta_bits, words);
+        PackBits(count_codes.data(), size, block.count_bits, words);
+        return block;
+    }
+
+    void Decode(const Block& block, DecodedBlock& decoded) const {
+        const uint32_t* packed = words_.data() + block.offset;
+        const auto& unpack_functions = GetUnpackFunctions();
+        unpack_functions[block.delta_bits](packed, block.size, decoded.indexes.data());
+        unpack_functions[block.count_bits](packed + GetPackedLength(block.size, block.delta_bits), block.size, decoded.counts.data());
+        uint32_t document_index = block.first_index;
+        for (size_t i = 0; i < block.size; ++i) {
+            document_index += decoded.indexes[i];
+            decoded.indexes[i] = document_index;
+            ++decoded.counts[i];
+        }
+    }
+
+    // First block at or after from whose last index is not less than document_index
+    const Block* FindBlock(size_t from, uint32_t document_index) const {
+        return std::lower_bound(blocks_.begin() + from, blocks_.end(), document_index, [](const Block& block, uint32_t index) {
+            return block.last_index < index;
+        });
+    }
+
+    const Block* FindBlock(uint32_t document_index) const {
+        return FindBlock(0, document_index);
+    }
+};
@@ -0,0 +1,187 @@
+// Checks CompressedPostingList against a map through random adds and removals, with gaps and
+// term counts of every size, and after renumbering, a snapshot round trip and copying. Also checks
+// that every unpack function the CPU supports gives back the packed values for every bit width.
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined compressed_postings_test.cpp -o compressed_postings_test
+#include "compressed_postings.h"
+#include "snapshot_file.h"
+#include "test_runner.h"
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using Postings = std::map<DocumentIndex, uint32_t>;
+
+void AssertSamePostings(const CompressedPostingList& postings, const Postings& expected, std::mt19937& generator) {
+    ASSERT(postings.size() == expected.size());
+    Postings visited;
+    postings.ForEach([&visited](DocumentIndex document_index, uint32_t term_count) {
+        ASSERT(visited.empty() || visited.rbegin()->first < document_index);
+        visited.emplace(document_index, term_count);
+    });
+    ASSERT(visited == expected);
+
+    const DocumentIndex last = expected.empty() ? 0 : expected.rbegin()->first;
+    for (int i = 0; i < 20; ++i) {
+        const DocumentIndex document_index = static_cast<DocumentIndex>(generator() % (last + 2));
+        const auto it = expected.find(document_index);
+        ASSERT(postings.FindTermCount(document_index) == (it == expected.end() ? 0 : it->second));
+    }
+
+    // Seeks forward by random steps, sometimes moving on with Next
+    CompressedPostingList::Cursor cursor(postings);
+    DocumentIndex target = 0;
+    while (true) {
+        target += generator() % 40;
+        cursor.Seek(target);
+        auto it = expected.lower_bound(target);
+        if (it == expected.end()) {
+            ASSERT(cursor.Document() == END_OF_POSTINGS);
+            break;
+        }
+        ASSERT(cursor.Document() == it->first);
+        ASSERT(cursor.TermCount() == it->second);
+        ASSERT(cursor.GetBlockBound(target).last_document >= it->first);
+        if (generator() % 2 == 0) {
+            cursor.Next();
+            ++it;
+            if (it == expected.end()) {
+                ASSERT(cursor.Document() == END_OF_POSTINGS);
+                break;
+            }
+            ASSERT(cursor.Document() == it->first);
+            target = it->first;
+        }
+    }
+}
+
+void TestAgainstMap() {
+    const std::string snapshot_path = (std::filesystem::temp_directory_path() / "compressed_postings_test.snap").string();
+    std::mt19937 generator(12);
+    for (int round = 0; round < 300; ++round) {
+        CompressedPostingList postings;
+        Postings expected;
+        DocumentIndex next = 0;
+        const int operation_count = static_cast<int>(generator() % 700);
+        // Dense lists, sparse ones and everything in between
+        const uint32_t max_gap = 1 + (generator() % 3 == 0 ? 2000 : generator() % 5 == 0 ? 1 : 30);
+        for (int i = 0; i < operation_count; ++i) {
+            if (!expected.empty() && generator() % 4 == 0) {
+                const auto it = std::next(expected.begin(), generator() % expected.size());
+                postings.Remove(it->first);
+                expected.erase(it);
+                // Removing an absent posting changes nothing
+                postings.Remove(next + 5);
+            } else {
+                next += 1 + generator() % max_gap;
+                const uint32_t term_count = 1 + (generator() % 6 == 0 ? generator() % 1000 : generator() % 3);
+                postings.Add(next, term_count, term_count * 0.01);
+                expected[next] = term_count;
+            }
+            if (i % 97 == 0) {
+                AssertSamePostings(postings, expected, generator);
+            }
+        }
+        AssertSamePostings(postings, expected, generator);
+
+        // Renumbering keeps the order and may leave gaps of its own
+        std::vector<DocumentIndex> new_indexes(next + 1, END_OF_POSTINGS);
+        DocumentIndex new_index = 0;
+        for (DocumentIndex document_index = 0; document_index <= next; ++document_index) {
+            if (expected.count(document_index) > 0) {
+                new_indexes[document_index] = new_index++;
+            } else if (generator() % 2 == 0) {
+                ++new_index;
+            }
+        }
+        postings.Renumber(new_indexes);
+        Postings renumbered;
+        for (const auto [document_index, term_count] : expected) {
+            renumbered.emplace(new_indexes[document_index], term_count);
+        }
+        expected = renumbered;
+        AssertSamePostings(postings, expected, generator);
+
+        {
+            SnapshotWriter writer(snapshot_path);
+            postings.Save(writer);
+            writer.Finish();
+        }
+        const MappedFile file(snapshot_path);
+        SnapshotReader reader(file);
+        CompressedPostingList opened = CompressedPostingList::Open(reader);
+        AssertSamePostings(opened, expected, generator);
+        // Adding to an opened list copies it out of the file first
+        DocumentIndex last = expected.empty() ? 0 : expected.rbegin()->first;
+        for (int i = 0; i < 50; ++i) {
+            last += 1 + generator() % 9;
+            opened.Add(last, 1, 0.1);
+            expected[last] = 1;
+        }
+        AssertSamePostings(opened, expected, generator);
+        const CompressedPostingList copy(opened);
+        AssertSamePostings(copy, expected, generator);
+    }
+    std::filesystem::remove(snapshot_path);
+}
+
+struct NamedUnpackFunctions {
+    std::string name;
+    std::array<UnpackFunction, 33> functions;
+};
+
+// Packs the values one bit at a time into exactly the words they need and the spare word
+std::vector<uint32_t> PackValues(const std::vector<uint32_t>& values, unsigned bits) {
+    std::vector<uint32_t> packed((values.size() * bits + 31) / 32 + 1, 0);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (unsigned bit = 0; bit < bits; ++bit) {
+            const size_t position = i * bits + bit;
+            packed[position / 32] |= ((values[i] >> bit) & 1u) << (position % 32);
+        }
+    }
+    return packed;
+}
+
+void TestUnpackFunctions() {
+    std::vector<NamedUnpackFunctions> unpack_functions{
+        {"UnpackBits", MakeUnpackTable(std::make_index_sequence<33>{})},
+    };
+#ifdef COMPRESSED_POSTINGS_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        unpack_functions.push_back({"UnpackBitsAvx2", MakeAvx2UnpackTable(std::make_index_sequence<33>{})});
+    }
+#endif
+
+    std::mt19937 generator(33);
+    for (unsigned bits = 0; bits <= 32; ++bits) {
+        const uint32_t mask = static_cast<uint32_t>((uint64_t{1} << bits) - 1);
+        for (size_t count = 0; count <= CompressedPostingList::BLOCK_SIZE; ++count) {
+            std::vector<uint32_t> values(count);
+            for (uint32_t& value : values) {
+                // All ones now and then, so every bit of a value is checked
+                value = generator() % 4 == 0 ? mask : static_cast<uint32_t>(generator()) & mask;
+            }
+            const std::vector<uint32_t> packed = PackValues(values, bits);
+            for (const NamedUnpackFunctions& unpack : unpack_functions) {
+                // Exactly the room for the values, so a sanitizer catches any write past them
+                std::vector<uint32_t> unpacked(count);
+                unpack.functions[bits](packed.data(), count, unpacked.data());
+                if (unpacked != values) {
+                    std::cerr << unpack.name << " failed on " << count << " values of " << bits << " bits" << std::endl;
+                }
+                ASSERT(unpacked == values);
+            }
+        }
+    }
+}
+
+int main() {
+    RUN_TEST(TestAgainstMap);
+    RUN_TEST(TestUnpackFunctions);
+}
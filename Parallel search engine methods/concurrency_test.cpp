@@ -0,0 +1,169 @@
+// Runs queries against the concurrent wrappers of SearchServer while other threads change
+// them, then compares the result with a SearchServer given the same documents. Meant to be
+// built with ThreadSanitizer, which reports any access the wrappers leave unsynchronized.
+// g++ -std=c++17 -O1 -g -fsanitize=thread concurrency_test.cpp -o concurrency_test -ltbb -lpthread
+#include "durable_search_server.h"
+#include "search_server.h"
+#include "segmented_search_server.h"
+#include "snapshot_search_server.h"
+#include "test_runner.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::string_literals;
+
+const int WORD_COUNT = 200;
+const int WRITER_COUNT = 2;
+const int READER_COUNT = 2;
+
+std::string MakeText(std::mt19937& generator) {
+    std::string text;
+    for (int i = 0; i < 6; ++i) {
+        text += "w"s + std::to_string(std::min(generator() % WORD_COUNT, generator() % WORD_COUNT)) + " "s;
+    }
+    return text;
+}
+
+std::vector<std::string> MakeQueries() {
+    std::mt19937 generator(5);
+    std::vector<std::string> queries;
+    for (int i = 0; i < 50; ++i) {
+        queries.push_back(MakeText(generator) + (i % 3 == 0 ? "-w"s + std::to_string(generator() % WORD_COUNT) : ""s));
+    }
+    return queries;
+}
+
+// Documents with equal relevance and rating may come in either order, so only those are compared
+void AssertSameResults(const std::vector<Document>& actual, const std::vector<Document>& expected) {
+    ASSERT(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        ASSERT(std::abs(actual[i].relevance - expected[i].relevance) < 1e-9);
+        ASSERT(actual[i].rating == expected[i].rating);
+    }
+}
+
+// Every writer adds documents of its own id range and removes every third of them.
+// Returns the server the wrapper must end up equal to
+template <typename Server>
+SearchServer RunWorkload(Server& server, int documents_per_writer, const std::vector<std::string>& queries) {
+    std::atomic<int> running_writers = WRITER_COUNT;
+    std::vector<std::thread> threads;
+    for (int writer = 0; writer < WRITER_COUNT; ++writer) {
+        threads.emplace_back([&, writer] {
+            std::mt19937 generator(writer);
+            for (int i = 0; i < documents_per_writer; ++i) {
+                const int document_id = writer * documents_per_writer + i;
+                server.AddDocument(document_id, MakeText(generator), DocumentStatus::ACTUAL, {i % 7});
+                if (i % 3 == 2) {
+                    server.RemoveDocument(document_id - 1);
+                }
+            }
+            --running_writers;
+        });
+    }
+    for (int reader = 0; reader < READER_COUNT; ++reader) {
+        threads.emplace_back([&, reader] {
+            size_t query = reader;
+            while (running_writers > 0) {
+                const std::vector<Document> documents = server.FindTopDocuments(queries[query++ % queries.size()]);
+                ASSERT(documents.size() <= MAX_RESULT_DOCUMENT_COUNT);
+                ASSERT(server.GetDocumentCount() >= 0);
+                // Leaves the writers room to make progress on a machine with few cores
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    SearchServer expected("and in"s);
+    for (int writer = 0; writer < WRITER_COUNT; ++writer) {
+        std::mt19937 generator(writer);
+        for (int i = 0; i < documents_per_writer; ++i) {
+            const int document_id = writer * documents_per_writer + i;
+            expected.AddDocument(document_id, MakeText(generator), DocumentStatus::ACTUAL, {i % 7});
+            if (i % 3 == 2) {
+                expected.RemoveDocument(document_id - 1);
+            }
+        }
+    }
+    return expected;
+}
+
+template <typename Server>
+void AssertSameServer(const Server& server, const SearchServer& expected, const std::vector<std::string>& queries) {
+    ASSERT(server.GetDocumentCount() == expected.GetDocumentCount());
+    for (const std::string& query : queries) {
+        AssertSameResults(server.FindTopDocuments(query), expected.FindTopDocuments(query));
+    }
+}
+
+void TestSnapshotServer() {
+    const std::vector<std::string> queries = MakeQueries();
+    SnapshotSearchServer server("and in"s);
+    std::atomic<bool> done = false;
+    // A pinned snapshot gives the same answer however the server changes meanwhile
+    std::thread pinning_reader([&] {
+        for (size_t query = 0; !done; ++query) {
+            const SnapshotSearchServer::Snapshot snapshot = server.GetSnapshot();
+            const std::vector<Document> first = snapshot->FindTopDocuments(queries[query % queries.size()]);
+            const std::vector<Document> second = snapshot->FindTopDocuments(queries[query % queries.size()]);
+            ASSERT(first.size() == second.size());
+            for (size_t i = 0; i < first.size(); ++i) {
+                ASSERT(first[i].id == second[i].id);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    const SearchServer expected = RunWorkload(server, 1000, queries);
+    done = true;
+    pinning_reader.join();
+    AssertSameServer(server, expected, queries);
+}
+
+void TestSegmentedServer() {
+    const std::vector<std::string> queries = MakeQueries();
+    SegmentedSearchServer server("and in"s);
+    // Enough documents to seal several segments and have them merged in the background
+    const SearchServer expected = RunWorkload(server, static_cast<int>(SEGMENT_DOCUMENT_COUNT * SEGMENT_MERGE_FACTOR / WRITER_COUNT) + 500, queries);
+    AssertSameServer(server, expected, queries);
+}
+
+void TestDurableServer() {
+    const std::vector<std::string> queries = MakeQueries();
+    const std::string directory = (std::filesystem::temp_directory_path() / "concurrency_test_durable").string();
+    std::filesystem::remove_all(directory);
+    std::optional<SearchServer> expected;
+    {
+        DurableSearchServer server(directory, "and in"s);
+        std::atomic<bool> done = false;
+        std::thread checkpointer([&] {
+            while (!done) {
+                server.Checkpoint();
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        });
+        expected.emplace(RunWorkload(server, 500, queries));
+        done = true;
+        checkpointer.join();
+        AssertSameServer(server, *expected, queries);
+    }
+    const DurableSearchServer reopened(directory, "ignored"s);
+    AssertSameServer(reopened, *expected, queries);
+    std::filesystem::remove_all(directory);
+}
+
+int main() {
+    RUN_TEST(TestSnapshotServer);
+    RUN_TEST(TestSegmentedServer);
+    RUN_TEST(TestDurableServer);
+}
@@ -0,0 +1,211 @@
+// Damages write-ahead logs and snapshots the way a crash or a bad disk would and checks that
+// recovery keeps exactly the complete records and rejects damaged snapshots. Also checks that
+// a durable server takes no more changes once its log cannot be written.
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined durability_test.cpp -o durability_test -ltbb -lpthread
+#include "durable_search_server.h"
+#include "search_server.h"
+#include "snapshot_file.h"
+#include "test_runner.h"
+#include "write_ahead_log.h"
+
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+using namespace std::string_literals;
+
+const std::filesystem::path TEST_DIRECTORY = std::filesystem::temp_directory_path() / "durability_test";
+
+std::string ReadFile(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void WriteFile(const std::filesystem::path& path, const std::string& content) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(content.data(), content.size());
+}
+
+std::vector<std::string> ReplayLog(const std::filesystem::path& path) {
+    std::vector<std::string> records;
+    WriteAheadLog log(path.string());
+    log.Replay([&records](std::string_view record) {
+        records.emplace_back(record);
+    });
+    return records;
+}
+
+void ResetTestDirectory() {
+    std::filesystem::remove_all(TEST_DIRECTORY);
+    std::filesystem::create_directories(TEST_DIRECTORY);
+}
+
+void TestLogKeepsCompleteRecords() {
+    ResetTestDirectory();
+    const std::filesystem::path path = TEST_DIRECTORY / "log";
+    const std::vector<std::string> records{"first"s, ""s, std::string(1000, 'x'), "last"s};
+    {
+        WriteAheadLog log(path.string());
+        log.Replay([](std::string_view) {});
+        for (const std::string& record : records) {
+            log.Commit(log.Append(record));
+        }
+    }
+    ASSERT(ReplayLog(path) == records);
+    const std::string complete = ReadFile(path);
+    const size_t last_record_size = sizeof(LogRecordHeader) + records.back().size();
+    const std::vector<std::string> kept(records.begin(), records.end() - 1);
+
+    // A crash in the middle of the last write leaves any prefix of its record
+    for (size_t cut = 1; cut <= last_record_size; ++cut) {
+        WriteFile(path, complete.substr(0, complete.size() - cut));
+        ASSERT(ReplayLog(path) == kept);
+        ASSERT(std::filesystem::file_size(path) == complete.size() - last_record_size);
+    }
+
+    // Garbage after the records is cut off, and the log goes on after the last good record
+    WriteFile(path, complete + "garbage that is no record"s);
+    {
+        WriteAheadLog log(path.string());
+        std::vector<std::string> replayed;
+        log.Replay([&replayed](std::string_view record) {
+            replayed.emplace_back(record);
+        });
+        ASSERT(replayed == records);
+        log.Commit(log.Append("after"s));
+    }
+    std::vector<std::string> extended = records;
+    extended.push_back("after"s);
+    ASSERT(ReplayLog(path) == extended);
+
+    // A damaged record ends the log, even if complete records follow it
+    std::string damaged = complete;
+    damaged[sizeof(LogRecordHeader) + 2] ^= 1;
+    WriteFile(path, damaged);
+    ASSERT(ReplayLog(path).empty());
+}
+
+void TestDurableServerRecovers() {
+    ResetTestDirectory();
+    const std::string directory = (TEST_DIRECTORY / "index").string();
+    {
+        DurableSearchServer server(directory, "and in"s);
+        server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, {1});
+        server.AddDocument(2, "dog and cat"s, DocumentStatus::ACTUAL, {2});
+        server.Checkpoint();
+        server.AddDocument(3, "cat on a mat"s, DocumentStatus::ACTUAL, {3});
+        server.RemoveDocument(1);
+    }
+    // A crash during a checkpoint leaves an unfinished snapshot behind
+    WriteFile(std::filesystem::path(directory) / "snapshot.3.tmp", "unfinished"s);
+    const std::filesystem::path log_path = std::filesystem::path(directory) / "log.2";
+    const std::string log = ReadFile(log_path);
+    WriteFile(log_path, log.substr(0, log.size() - 3));
+    {
+        // The stop words come from the first snapshot, not from the arguments
+        DurableSearchServer server(directory, "cat"s);
+        ASSERT(!std::filesystem::exists(std::filesystem::path(directory) / "snapshot.3.tmp"));
+        // The removal was torn off, the addition before it is kept
+        ASSERT(server.GetDocumentCount() == 3);
+        ASSERT(server.FindTopDocuments("cat"s).size() == 3);
+        ASSERT(server.FindTopDocuments("and"s).empty());
+        ASSERT_THROWS(server.AddDocument(3, "again"s, DocumentStatus::ACTUAL, {}), std::invalid_argument);
+        ASSERT_THROWS(server.AddDocument(4, "bad\x01word"s, DocumentStatus::ACTUAL, {}), std::invalid_argument);
+        server.RemoveDocument(1);
+    }
+    {
+        DurableSearchServer server(directory, "cat"s);
+        ASSERT(server.GetDocumentCount() == 2);
+    }
+}
+
+void TestDurableServerBecomesReadOnly() {
+    ResetTestDirectory();
+    const std::string directory = (TEST_DIRECTORY / "index").string();
+    {
+        DurableSearchServer server(directory, "and in"s);
+        server.AddDocument(1, "cat"s, DocumentStatus::ACTUAL, {1});
+        // Writes past the file size limit fail instead of killing the process
+        std::signal(SIGXFSZ, SIG_IGN);
+        rlimit limit{};
+        getrlimit(RLIMIT_FSIZE, &limit);
+        const rlim_t old_limit = limit.rlim_cur;
+        limit.rlim_cur = std::filesystem::file_size(std::filesystem::path(directory) / "log.1") + 16;
+        setrlimit(RLIMIT_FSIZE, &limit);
+        ASSERT_THROWS(server.AddDocument(2, std::string(100, 'z'), DocumentStatus::ACTUAL, {}), std::runtime_error);
+        limit.rlim_cur = old_limit;
+        setrlimit(RLIMIT_FSIZE, &limit);
+
+        // The failed change never shows, and no change after it is taken
+        ASSERT(server.GetDocumentCount() == 1);
+        ASSERT(server.FindTopDocuments(std::string(100, 'z')).empty());
+        ASSERT_THROWS(server.AddDocument(3, "dog"s, DocumentStatus::ACTUAL, {}), std::runtime_error);
+        ASSERT_THROWS(server.RemoveDocument(1), std::runtime_error);
+        ASSERT(server.GetDocumentCount() == 1);
+    }
+    DurableSearchServer server(directory, "and in"s);
+    ASSERT(server.GetDocumentCount() == 1);
+    server.AddDocument(3, "dog"s, DocumentStatus::ACTUAL, {});
+    ASSERT(server.GetDocumentCount() == 2);
+}
+
+void TestDamagedSnapshotsAreRejected() {
+    ResetTestDirectory();
+    const std::filesystem::path path = TEST_DIRECTORY / "index.snap";
+    const std::filesystem::path damaged_path = TEST_DIRECTORY / "damaged.snap";
+    for (const IndexFormat index_format : {IndexFormat::PLAIN, IndexFormat::COMPRESSED}) {
+        SearchServer server("and in"s, index_format);
+        for (int id = 0; id < 300; ++id) {
+            server.AddDocument(id, "w"s + std::to_string(id % 17) + " w"s + std::to_string(id % 5) + " and"s, DocumentStatus::ACTUAL, {id});
+        }
+        server.SaveSnapshot(path.string());
+        const std::string snapshot = ReadFile(path);
+        ASSERT(SearchServer::OpenSnapshot(path.string()).GetDocumentCount() == 300);
+
+        for (size_t position = 0; position < snapshot.size(); position += 1 + position / 8) {
+            // The bytes between the header and the payload are never read
+            if (position >= sizeof(SnapshotHeader) && position < SNAPSHOT_PAYLOAD_OFFSET) {
+                continue;
+            }
+            std::string damaged = snapshot;
+            damaged[position] ^= 0x10;
+            WriteFile(damaged_path, damaged);
+            ASSERT_THROWS(SearchServer::OpenSnapshot(damaged_path.string()), std::runtime_error);
+        }
+        for (size_t size = 0; size < snapshot.size(); size += 1 + size / 4) {
+            WriteFile(damaged_path, snapshot.substr(0, size));
+            ASSERT_THROWS(SearchServer::OpenSnapshot(damaged_path.string()), std::runtime_error);
+        }
+    }
+}
+
+void TestUnfinishedSnapshotKeepsOldFile() {
+    ResetTestDirectory();
+    const std::filesystem::path path = TEST_DIRECTORY / "index.snap";
+    SearchServer server("and in"s);
+    server.AddDocument(1, "cat"s, DocumentStatus::ACTUAL, {1});
+    server.SaveSnapshot(path.string());
+    const std::string saved = ReadFile(path);
+    {
+        SnapshotWriter writer(path.string());
+        writer.Write(uint64_t{42});
+        // Dropped before Finish, as if the process died
+    }
+    ASSERT(ReadFile(path) == saved);
+    ASSERT(!std::filesystem::exists(path.string() + ".tmp"));
+    ASSERT(SearchServer::OpenSnapshot(path.string()).GetDocumentCount() == 1);
+}
+
+int main() {
+    RUN_TEST(TestLogKeepsCompleteRecords);
+    RUN_TEST(TestDurableServerRecovers);
+    RUN_TEST(TestDurableServerBecomesReadOnly);
+    RUN_TEST(TestDamagedSnapshotsAreRejected);
+    RUN_TEST(TestUnfinishedSnapshotKeepsOldFile);
+    std::filesystem::remove_all(TEST_DIRECTORY);
+}
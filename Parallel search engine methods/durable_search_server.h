@@ -0,0 +1,297 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "search_server.h"
+#include "string_processing.h"
+#include "write_ahead_log.h"
+
+// Once the log grows past this many bytes, the next write takes a snapshot and starts a new log,
+// so recovery never replays more than this
+const size_t LOG_CHECKPOINT_SIZE = size_t{64} << 20;
+
+// SearchServer whose changes survive a crash. Every AddDocument and RemoveDocument is checked,
+// recorded in a write-ahead log and applied only once the record is on disk; concurrent writers
+// share one fsync. The directory holds the latest snapshot and the log of the changes made after
+// it, both numbered by the checkpoint that created them. Opening the directory maps the snapshot
+// and replays the log on top of it.
+// Queries run concurrently with each other and see only durable changes, possibly before their
+// writer returns. If the log cannot be written, the failed change is not applied and the server
+// takes no more changes
+class DurableSearchServer {
+public:
+    // The stop words and the index format apply only if the directory holds no snapshot yet.
+    // A new directory gets an empty snapshot right away, which keeps them from then on
+    template <typename StringContainer>
+    DurableSearchServer(const std::string& directory, const StringContainer& stop_words, IndexFormat index_format = IndexFormat::PLAIN)
+        : directory_(directory)
+        , checkpoint_(FindLatestCheckpoint(directory))
+        , server_(checkpoint_ > 0 ? SearchServer::OpenSnapshot(GetSnapshotPath(checkpoint_)) : SearchServer(stop_words, index_format)) {
+        if (checkpoint_ == 0) {
+            WriteCheckpoint();
+            return;
+        }
+        log_ = std::make_shared<WriteAheadLog>(GetLogPath(checkpoint_));
+        log_->Replay([this](std::string_view record) {
+            ApplyRecord(record);
+        });
+        RemoveOlderCheckpoints();
+        SyncPath(directory_);
+    }
+
+    DurableSearchServer(const std::string& directory, const std::string& stop_words_text, IndexFormat index_format = IndexFormat::PLAIN)
+        : DurableSearchServer(directory, SplitIntoWords(stop_words_text), index_format) {
+    }
+
+    DurableSearchServer(const DurableSearchServer&) = delete;
+    DurableSearchServer& operator=(const DurableSearchServer&) = delete;
+
+    void AddDocument(int document_id, std::string_view document, DocumentStatus status, const std::vector<int>& ratings) {
+        std::string record;
+        AppendValue(record, LogOperation::ADD_DOCUMENT);
+        AppendValue(record, static_cast<int32_t>(document_id));
+        AppendValue(record, static_cast<uint8_t>(status));
+        AppendValue(record, static_cast<uint32_t>(ratings.size()));
+        for (const int rating : ratings) {
+            AppendValue(record, static_cast<int32_t>(rating));
+        }
+        record.append(document);
+
+        std::unique_lock lock(write_mutex_);
+        // Invalid documents throw here, before anything is logged
+        if (document_id < 0 || HasDocument(document_id)) {
+            throw std::invalid_argument("Invalid document_id");
+        }
+        SearchServer::CheckDocumentText(document);
+        Commit(std::move(lock), {document_id, LogOperation::ADD_DOCUMENT, std::move(record)});
+    }
+
+    void RemoveDocument(int document_id) {
+        std::string record;
+        AppendValue(record, LogOperation::REMOVE_DOCUMENT);
+        AppendValue(record, static_cast<int32_t>(document_id));
+
+        std::unique_lock lock(write_mutex_);
+        if (!HasDocument(document_id)) {
+            return;
+        }
+        Commit(std::move(lock), {document_id, LogOperation::REMOVE_DOCUMENT, std::move(record)});
+    }
+
+    template <typename... Args>
+    std::vector<Document> FindTopDocuments(Args&&... args) const {
+        std::shared_lock lock(mutex_);
+        return server_.FindTopDocuments(std::forward<Args>(args)...);
+    }
+
+    int GetDocumentCount() const {
+        std::shared_lock lock(mutex_);
+        return server_.GetDocumentCount();
+    }
+
+    // Saves a snapshot of the index and starts an empty log. Writers wait until it is done,
+    // queries go on meanwhile
+    void Checkpoint() {
+        std::lock_guard lock(write_mutex_);
+        WriteCheckpoint();
+    }
+
+private:
+    enum class LogOperation : uint8_t {
+        ADD_DOCUMENT,
+        REMOVE_DOCUMENT,
+    };
+
+    template <typename T>
+    static void AppendValue(std::string& record, T value) {
+        record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static T ReadValue(std::string_view& record) {
+        if (record.size() < sizeof(T)) {
+            throw std::runtime_error("Log is corrupted");
+        }
+        T value;
+        std::memcpy(&value, record.data(), sizeof(T));
+        record.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    // A change that is logged but not yet applied
+    struct PendingChange {
+        int document_id;
+        LogOperation operation;
+        std::string record;
+        // Position among all logged changes
+        uint64_t number = 0;
+    };
+
+    // Whether the document exists once the pending changes are applied. Called under
+    // write_mutex_, which every change of server_ holds as well
+    bool HasDocument(int document_id) const {
+        for (auto it = pending_.rbegin(); it != pending_.rend(); ++it) {
+            if (it->document_id == document_id) {
+                return it->operation == LogOperation::ADD_DOCUMENT;
+            }
+        }
+        return server_.HasDocument(document_id);
+    }
+
+    void ApplyRecord(std::string_view record) {
+        const auto operation = ReadValue<LogOperation>(record);
+        const int document_id = ReadValue<int32_t>(record);
+        if (operation == LogOperation::REMOVE_DOCUMENT) {
+            server_.RemoveDocument(document_id);
+            return;
+        }
+        if (operation != LogOperation::ADD_DOCUMENT) {
+            throw std::runtime_error("Log is corrupted");
+        }
+        const uint8_t status = ReadValue<uint8_t>(record);
+        if (status > static_cast<uint8_t>(DocumentStatus::REMOVED)) {
+            throw std::runtime_error("Log is corrupted");
+        }
+        std::vector<int> ratings(ReadValue<uint32_t>(record));
+        for (int& rating : ratings) {
+            rating = ReadValue<int32_t>(record);
+        }
+        server_.AddDocument(document_id, record, static_cast<DocumentStatus>(status), ratings);
+    }
+
+    // Logs a checked change, waits until its record is durable and applies it along with the
+    // changes logged before it. The lock is released while waiting, so writers that come
+    // meanwhile join the same fsync. If the log cannot be written, the change is dropped and
+    // the writer gets an exception
+    void Commit(std::unique_lock<std::mutex> lock, PendingChange change) {
+        const std::shared_ptr<WriteAheadLog> log = log_;
+        const uint64_t sequence = log->Append(change.record);
+        const uint64_t number = change.number = ++logged_change_count_;
+        pending_.push_back(std::move(change));
+        lock.unlock();
+        try {
+            log->Commit(sequence);
+        } catch (...) {
+            lock.lock();
+            const auto it = std::find_if(pending_.begin(), pending_.end(), [number](const PendingChange& pending) {
+                return pending.number == number;
+            });
+            if (it != pending_.end()) {
+                pending_.erase(it);
+            }
+            throw;
+        }
+        lock.lock();
+        ApplyPendingChanges(number);
+        if (log_ == log && log->GetSize() >= LOG_CHECKPOINT_SIZE) {
+            WriteCheckpoint();
+        }
+    }
+
+    // Records reach the disk in the order they were logged, so once the record of a change is
+    // durable, so are those of all the changes before it
+    void ApplyPendingChanges(uint64_t last_number) {
+        if (pending_.empty() || pending_.front().number > last_number) {
+            return;
+        }
+        std::unique_lock lock(mutex_);
+        while (!pending_.empty() && pending_.front().number <= last_number) {
+            ApplyRecord(pending_.front().record);
+            pending_.pop_front();
+        }
+    }
+
+    // A crash at any point leaves either the old snapshot with its complete log or the new
+    // snapshot, which already holds every change of that log. Called under write_mutex_, so
+    // the index cannot change while it is saved and queries only have to share it
+    void WriteCheckpoint() {
+        // Writers still waiting on the old log find their records durable and applied
+        if (log_) {
+            log_->Sync();
+        }
+        ApplyPendingChanges(logged_change_count_);
+        const uint64_t checkpoint = checkpoint_ + 1;
+        {
+            std::shared_lock lock(mutex_);
+            server_.SaveSnapshot(GetSnapshotPath(checkpoint));
+        }
+        auto log = std::make_shared<WriteAheadLog>(GetLogPath(checkpoint));
+        SyncPath(directory_);
+        log_ = std::move(log);
+        checkpoint_ = checkpoint;
+        RemoveOlderCheckpoints();
+    }
+
+    std::string GetSnapshotPath(uint64_t checkpoint) const {
+        return directory_ + "/snapshot." + std::to_string(checkpoint);
+    }
+
+    std::string GetLogPath(uint64_t checkpoint) const {
+        return directory_ + "/log." + std::to_string(checkpoint);
+    }
+
+    // Zero if there is no snapshot yet
+    static uint64_t FindLatestCheckpoint(const std::string& directory) {
+        std::filesystem::create_directories(directory);
+        uint64_t latest = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            const auto checkpoint = ParseCheckpoint(entry.path().filename().string(), "snapshot.");
+            if (checkpoint) {
+                latest = std::max(latest, *checkpoint);
+            }
+        }
+        return latest;
+    }
+
+    static std::optional<uint64_t> ParseCheckpoint(std::string_view file_name, std::string_view prefix) {
+        if (file_name.substr(0, prefix.size()) != prefix || file_name.size() == prefix.size()
+            || file_name.find_first_not_of("0123456789", prefix.size()) != std::string_view::npos) {
+            return std::nullopt;
+        }
+        return std::stoull(std::string(file_name.substr(prefix.size())));
+    }
+
+    // Also removes snapshots left unfinished by a crash during a checkpoint
+    void RemoveOlderCheckpoints() const {
+        std::vector<std::filesystem::path> stale_paths;
+        for (const auto& entry : std::filesystem::directory_iterator(directory_)) {
+            const std::string file_name = entry.path().filename().string();
+            const auto snapshot = ParseCheckpoint(file_name, "snapshot.");
+            const auto log = ParseCheckpoint(file_name, "log.");
+            const bool unfinished = file_name.size() > 4 && file_name.compare(file_name.size() - 4, 4, ".tmp") == 0;
+            if ((snapshot && *snapshot < checkpoint_) || (log && *log < checkpoint_) || unfinished) {
+                stale_paths.push_back(entry.path());
+            }
+        }
+        for (const auto& path : stale_paths) {
+            std::filesystem::remove(path);
+        }
+    }
+
+    const std::string directory_;
+    uint64_t checkpoint_;
+    SearchServer server_;
+    // Shared with writers still committing to it after a checkpoint replaced it
+    std::shared_ptr<WriteAheadLog> log_;
+    // Writers check, log and apply their changes in one order under this lock, which
+    // they release only while waiting for the log
+    std::mutex write_mutex_;
+    // Changes logged but not yet durable, in the order of the log
+    std::deque<PendingChange> pending_;
+    uint64_t logged_change_count_ = 0;
+    // Queries share it; applying a change takes it exclusively
+    mutable std::shared_mutex mutex_;
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "mapped_array.h"
+#include "posting_list.h"
+#include "snapshot_file.h"
+#include "term_dictionary.h"
+
+// Terms of every document with their counts, sorted by term. A term is stored as a
+// variable-length code of its gap from the previous term of the document, followed by
+// the code of its count, seven bits to a byte, so most terms take two or three bytes.
+// The codes of all documents lie in one array of at most MappedArray::MAX_SIZE bytes,
+// just under 4 GiB, and every document also costs the offset where its codes end.
+// A document that would not fit throws std::length_error.
+// Removed documents keep their codes until Compact drops them
+class ForwardIndex {
+public:
+    // Starts the next document; AddTerm then appends to it
+    void AddDocument() {
+        ends_.push_back(codes_.size());
+        last_term_ = 0;
+    }
+
+    // Terms must come in increasing order
+    void AddTerm(TermId term, uint32_t count) {
+        AppendCode(term - last_term_);
+        AppendCode(count);
+        last_term_ = term;
+        ends_.Mutable()[ends_.size() - 1] = codes_.size();
+    }
+
+    // Drops the documents from document_count on, also one that AddTerm failed to finish
+    void Truncate(size_t document_count) {
+        if (document_count < ends_.size()) {
+            codes_.resize(GetBegin(static_cast<DocumentIndex>(document_count)));
+            ends_.resize(document_count);
+        }
+    }
+
+    // Calls action(term, count) for the terms of the document in increasing order
+    template <typename Action>
+    void ForEach(DocumentIndex document_index, Action action) const {
+        const uint8_t* position = codes_.data() + GetBegin(document_index);
+        const uint8_t* const end = codes_.data() + ends_[document_index];
+        TermId term = 0;
+        while (position != end) {
+            term += ReadCode(position, end);
+            action(term, ReadCode(position, end));
+        }
+    }
+
+    size_t GetDocumentCount() const {
+        return ends_.size();
+    }
+
+    // Drops the documents whose new index is END_OF_POSTINGS and moves the rest up;
+    // new_indexes must keep the order of the documents
+    void Compact(const std::vector<DocumentIndex>& new_indexes) {
+        uint8_t* codes = codes_.Mutable();
+        uint64_t* ends = ends_.Mutable();
+        size_t code_count = 0;
+        size_t document_count = 0;
+        size_t begin = 0;
+        for (size_t document_index = 0; document_index < ends_.size(); ++document_index) {
+            const size_t end = ends[document_index];
+            if (new_indexes[document_index] != END_OF_POSTINGS) {
+                std::copy(codes + begin, codes + end, codes + code_count);
+                code_count += end - begin;
+                ends[document_count++] = code_count;
+            }
+            begin = end;
+        }
+        codes_.resize(code_count);
+        ends_.resize(document_count);
+        // Copies of owned arrays have no spare capacity
+        codes_ = MappedArray<uint8_t>(codes_);
+        ends_ = MappedArray<uint64_t>(ends_);
+    }
+
+    void Save(SnapshotWriter& writer) const {
+        writer.WriteArray(ends_);
+        writer.WriteArray(codes_);
+    }
+
+    // The codes are read from the mapping until the index is first changed.
+    // Every document is decoded once to check it
+    static ForwardIndex Open(SnapshotReader& reader, size_t term_count) {
+        ForwardIndex index;
+        index.ends_ = reader.ReadArray<uint64_t>();
+        index.codes_ = reader.ReadArray<uint8_t>();
+        if ((index.ends_.empty() ? 0 : index.ends_.back()) != index.codes_.size()) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        for (DocumentIndex document_index = 0; document_index < index.ends_.size(); ++document_index) {
+            if (index.GetBegin(document_index) > index.ends_[document_index]) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+            size_t previous_term = 0;
+            bool first = true;
+            index.ForEach(document_index, [&](TermId term, uint32_t count) {
+                if (term >= term_count || (!first && term <= previous_term) || count == 0) {
+                    throw std::runtime_error("Snapshot is corrupted");
+                }
+                previous_term = term;
+                first = false;
+            });
+        }
+        return index;
+    }
+
+private:
+    size_t GetBegin(DocumentIndex document_index) const {
+        return document_index == 0 ? 0 : ends_[document_index - 1];
+    }
+
+    void AppendCode(uint32_t value) {
+        while (value >= 0x80) {
+            codes_.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        codes_.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Codes never run past the end of their document, not even in a corrupted snapshot
+    static uint32_t ReadCode(const uint8_t*& position, const uint8_t* end) {
+        uint32_t value = 0;
+        for (unsigned shift = 0; shift < 32; shift += 7) {
+            if (position == end) {
+                break;
+            }
+            const uint8_t byte = *position++;
+            value |= uint32_t{byte & 0x7Fu} << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Snapshot is corrupted");
+    }
+
+    MappedArray<uint64_t> ends_;
+    MappedArray<uint8_t> codes_;
+    // Last term added to the newest document
+    TermId last_term_ = 0;
+};
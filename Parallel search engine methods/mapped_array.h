@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Array that either owns its elements or views elements that live elsewhere, such as in a
+// memory-mapped snapshot. Reading works the same either way; the first change copies
+// viewed elements into an array of its own.
+// Every posting list holds a few of these, so the array takes 16 bytes, less than a vector:
+// the size and the capacity are 32-bit, and a view is an array with elements but no capacity
+template <typename T>
+class MappedArray {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    MappedArray() = default;
+
+    MappedArray(const std::vector<T>& elements) {
+        Assign(elements.data(), elements.size());
+    }
+
+    // A copy of a view views the same elements, a copy of an owned array has no spare capacity
+    MappedArray(const MappedArray& other) {
+        if (other.IsView()) {
+            data_ = other.data_;
+            size_ = other.size_;
+        } else {
+            Assign(other.data_, other.size_);
+        }
+    }
+
+    MappedArray(MappedArray&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr))
+        , size_(std::exchange(other.size_, 0))
+        , capacity_(std::exchange(other.capacity_, 0)) {
+    }
+
+    MappedArray& operator=(MappedArray other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        return *this;
+    }
+
+    ~MappedArray() {
+        if (capacity_ > 0) {
+            std::free(data_);
+        }
+    }
+
+    // The elements must outlive the array and every copy of it
+    static MappedArray View(const T* data, size_t size) {
+        MappedArray result;
+        result.data_ = size > 0 ? const_cast<T*>(data) : nullptr;
+        result.size_ = CheckSize(size);
+        return result;
+    }
+
+    const T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+    const T& back() const {
+        return data_[size_ - 1];
+    }
+
+    // The changes below invalidate pointers to the elements, like any change of a vector
+
+    // Grows the capacity geometrically, like a vector, but never past MAX_SIZE, so every
+    // size up to it can be reached. Changes that stay within the capacity of an owned array
+    // allocate nothing and cannot throw
+    void reserve(size_t size) {
+        if (size > capacity_) {
+            const size_t grown = std::min<size_t>(size_t{capacity_} * 2, MAX_SIZE);
+            // A view has no capacity yet keeps all of its elements
+            Reallocate(std::max<size_t>({CheckSize(size), size_, grown}));
+        }
+    }
+
+    T* Mutable() {
+        if (IsView()) {
+            Reallocate(size_);
+        }
+        return data_;
+    }
+
+    void push_back(const T& value) {
+        reserve(size_t{size_} + 1);
+        data_[size_++] = value;
+    }
+
+    // New elements are zero
+    void resize(size_t size) {
+        reserve(size);
+        Mutable();
+        if (size > size_) {
+            std::memset(static_cast<void*>(data_ + size_), 0, (size - size_) * sizeof(T));
+        }
+        size_ = static_cast<uint32_t>(size);
+    }
+
+    void insert(size_t position, const T* first, const T* last) {
+        const size_t count = last - first;
+        reserve(size_t{size_} + count);
+        Mutable();
+        std::memmove(static_cast<void*>(data_ + position + count), data_ + position, (size_ - position) * sizeof(T));
+        std::memcpy(static_cast<void*>(data_ + position), first, count * sizeof(T));
+        size_ += static_cast<uint32_t>(count);
+    }
+
+    void erase(size_t first, size_t last) {
+        Mutable();
+        std::memmove(static_cast<void*>(data_ + first), data_ + last, (size_ - last) * sizeof(T));
+        size_ -= static_cast<uint32_t>(last - first);
+    }
+
+    void clear() {
+        *this = MappedArray();
+    }
+
+    static constexpr size_t MAX_SIZE = std::numeric_limits<uint32_t>::max();
+
+private:
+    static uint32_t CheckSize(size_t size) {
+        if (size > MAX_SIZE) {
+            throw std::length_error("Array is too long");
+        }
+        return static_cast<uint32_t>(size);
+    }
+
+    bool IsView() const {
+        return capacity_ == 0 && data_ != nullptr;
+    }
+
+    void Assign(const T* data, size_t size) {
+        if (size > 0) {
+            Reallocate(size);
+            std::memcpy(static_cast<void*>(data_), data, size * sizeof(T));
+            size_ = static_cast<uint32_t>(size);
+        }
+    }
+
+    void Reallocate(size_t capacity) {
+        const uint32_t checked_capacity = CheckSize(capacity);
+        T* data;
+        if (IsView()) {
+            data = static_cast<T*>(std::malloc(capacity * sizeof(T)));
+            if (data != nullptr) {
+                std::memcpy(static_cast<void*>(data), data_, std::min<size_t>(size_, capacity) * sizeof(T));
+            }
+        } else {
+            data = static_cast<T*>(std::realloc(static_cast<void*>(data_), capacity * sizeof(T)));
+        }
+        if (data == nullptr) {
+            throw std::bad_alloc();
+        }
+        data_ = data;
+        capacity_ = checked_capacity;
+    }
+
+    T* data_ = nullptr;
+    uint32_t size_ = 0;
+    uint32_t capacity_ = 0;
+};
@@ -0,0 +1,270 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "mapped_array.h"
+#include "snapshot_file.h"
+
+// Documents are numbered densely in order of addition. Removed documents leave gaps until
+// the server renumbers the rest, which keeps their order
+using DocumentIndex = uint32_t;
+
+// Index of the cursor position past the last posting
+constexpr DocumentIndex END_OF_POSTINGS = std::numeric_limits<DocumentIndex>::max();
+
+// Upper bound of the term frequencies of a run of postings ending at last_document
+struct BlockBound {
+    DocumentIndex last_document;
+    double max_term_freq;
+};
+
+// Postings sorted by document index. Indexes and term frequencies are kept in separate
+// arrays, so the indexes can be fed to the sorted set operations as they are.
+// Along with them the list keeps an upper bound of the term frequencies of the whole list
+// and of every block of BLOCK_SIZE postings. Most lists fit in one block, whose bound is then
+// the exact bound of the list, so block bounds are stored only for longer lists.
+// A list opened from a snapshot reads its arrays from the mapping until it is first changed
+class PostingList {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+
+    // Walks the postings in order, moving only forward
+    class Cursor {
+    public:
+        explicit Cursor(const PostingList& postings)
+            : postings_(&postings) {
+        }
+
+        DocumentIndex Document() const {
+            return position_ < postings_->document_indexes_.size() ? postings_->document_indexes_[position_] : END_OF_POSTINGS;
+        }
+
+        double TermFreq() const {
+            return postings_->term_freqs_[position_];
+        }
+
+        // Moves to the first posting whose document is not less than target
+        void Seek(DocumentIndex target) {
+            position_ = postings_->Find(position_, target);
+        }
+
+        void Next() {
+            ++position_;
+        }
+
+        double GetMaxTermFreq() const {
+            return postings_->max_term_freq_;
+        }
+
+        // Bound of the block that holds the first posting not less than target
+        BlockBound GetBlockBound(DocumentIndex target) const {
+            const size_t position = postings_->Find(position_, target);
+            if (position == postings_->size()) {
+                return {END_OF_POSTINGS, 0.0};
+            }
+            const size_t block = position / BLOCK_SIZE;
+            const size_t block_end = std::min(postings_->size(), (block + 1) * BLOCK_SIZE);
+            const auto& block_max_term_freqs = postings_->block_max_term_freqs_;
+            return {postings_->document_indexes_[block_end - 1],
+                    block_max_term_freqs.empty() ? postings_->max_term_freq_ : block_max_term_freqs[block]};
+        }
+
+    private:
+        const PostingList* postings_;
+        size_t position_ = 0;
+    };
+
+    // The document index must exceed every index already in the list.
+    // Everything is allocated first, so a list that fails to grow stays as it was
+    void Add(DocumentIndex document_index, double term_freq) {
+        document_indexes_.reserve(size() + 1);
+        term_freqs_.reserve(size() + 1);
+        block_max_term_freqs_.reserve(GetBlockCount(size() + 1));
+        if (size() == BLOCK_SIZE) {
+            // The list gets its second block; the exact bound of the list so far is the one of the first
+            block_max_term_freqs_.push_back(max_term_freq_);
+        }
+        if (size() % BLOCK_SIZE == 0 && size() > 0) {
+            block_max_term_freqs_.push_back(term_freq);
+        } else if (size() > BLOCK_SIZE) {
+            double& block_max_term_freq = block_max_term_freqs_.Mutable()[block_max_term_freqs_.size() - 1];
+            block_max_term_freq = std::max(block_max_term_freq, term_freq);
+        }
+        max_term_freq_ = std::max(max_term_freq_, term_freq);
+        document_indexes_.push_back(document_index);
+        term_freqs_.push_back(term_freq);
+    }
+
+    bool Contains(DocumentIndex document_index) const {
+        const size_t position = Find(0, document_index);
+        return position < size() && document_indexes_[position] == document_index;
+    }
+
+    void Remove(DocumentIndex document_index) {
+        const size_t position = Find(0, document_index);
+        if (position == size() || document_indexes_[position] != document_index) {
+            return;
+        }
+        document_indexes_.erase(position, position + 1);
+        term_freqs_.erase(position, position + 1);
+        if (size() <= BLOCK_SIZE) {
+            block_max_term_freqs_.clear();
+            max_term_freq_ = empty() ? 0.0 : *std::max_element(term_freqs_.begin(), term_freqs_.end());
+            return;
+        }
+        // Later postings moved one place back, so the blocks from this one on are recomputed.
+        // The bound of the whole list may only become loose, which is still correct
+        block_max_term_freqs_.resize(GetBlockCount(size()));
+        double* block_max_term_freqs = block_max_term_freqs_.Mutable();
+        for (size_t block = position / BLOCK_SIZE; block < block_max_term_freqs_.size(); ++block) {
+            const auto block_begin = term_freqs_.begin() + block * BLOCK_SIZE;
+            const auto block_end = term_freqs_.begin() + std::min(size(), (block + 1) * BLOCK_SIZE);
+            block_max_term_freqs[block] = *std::max_element(block_begin, block_end);
+        }
+    }
+
+    // Position of the first posting at or after from whose document is not less than target
+    size_t Find(size_t from, DocumentIndex target) const {
+        return std::lower_bound(document_indexes_.begin() + from, document_indexes_.end(), target) - document_indexes_.begin();
+    }
+
+    template <typename Action>
+    void ForEach(Action action) const {
+        for (size_t position = 0; position < size(); ++position) {
+            action(document_indexes_[position], term_freqs_[position]);
+        }
+    }
+
+    // Maps every document index through new_indexes, which must keep their order
+    void Renumber(const std::vector<DocumentIndex>& new_indexes) {
+        DocumentIndex* document_indexes = document_indexes_.Mutable();
+        for (size_t position = 0; position < size(); ++position) {
+            document_indexes[position] = new_indexes[document_indexes[position]];
+        }
+    }
+
+    const MappedArray<DocumentIndex>& GetDocuments() const {
+        return document_indexes_;
+    }
+
+    size_t size() const {
+        return document_indexes_.size();
+    }
+
+    bool empty() const {
+        return document_indexes_.empty();
+    }
+
+    void Save(SnapshotWriter& writer) const {
+        writer.WriteArray(document_indexes_);
+        writer.WriteArray(term_freqs_);
+        writer.WriteArray(block_max_term_freqs_);
+        writer.Write(max_term_freq_);
+    }
+
+    static PostingList Open(SnapshotReader& reader) {
+        PostingList postings;
+        postings.document_indexes_ = reader.ReadArray<DocumentIndex>();
+        postings.term_freqs_ = reader.ReadArray<double>();
+        postings.block_max_term_freqs_ = reader.ReadArray<double>();
+        postings.max_term_freq_ = reader.Read<double>();
+        if (postings.term_freqs_.size() != postings.size() || postings.block_max_term_freqs_.size() != GetBlockCount(postings.size())) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        return postings;
+    }
+
+private:
+    // Blocks with a bound of their own
+    static size_t GetBlockCount(size_t size) {
+        return size > BLOCK_SIZE ? (size + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+    }
+
+    MappedArray<DocumentIndex> document_indexes_;
+    MappedArray<double> term_freqs_;
+    MappedArray<double> block_max_term_freqs_;
+    double max_term_freq_ = 0.0;
+};
+
+// Posting lists of one term by partition, such as the status of the documents. Most terms
+// occur in few documents, so only the non-empty lists are kept, in a short vector
+template <typename List>
+class PartitionedPostings {
+public:
+    // An empty list if the partition has no postings
+    const List& Get(size_t partition) const {
+        for (const auto& [list_partition, list] : lists_) {
+            if (list_partition == partition) {
+                return list;
+            }
+        }
+        return EMPTY_LIST;
+    }
+
+    // Changes the list of the partition, which is added first if needed and dropped once empty
+    template <typename Function>
+    void Change(size_t partition, Function change) {
+        auto it = std::find_if(lists_.begin(), lists_.end(), [partition](const auto& entry) {
+            return entry.first == partition;
+        });
+        if (it == lists_.end()) {
+            it = lists_.emplace(lists_.end(), static_cast<uint8_t>(partition), List{});
+        }
+        try {
+            change(it->second);
+        } catch (...) {
+            if (it->second.size() == 0) {
+                lists_.erase(it);
+            }
+            throw;
+        }
+        if (it->second.size() == 0) {
+            lists_.erase(it);
+        }
+    }
+
+    template <typename Function>
+    void ChangeAll(Function change) {
+        for (auto& [partition, list] : lists_) {
+            change(list);
+        }
+    }
+
+    void Save(SnapshotWriter& writer) const {
+        writer.Write(static_cast<uint64_t>(lists_.size()));
+        for (const auto& [partition, list] : lists_) {
+            writer.Write(static_cast<uint64_t>(partition));
+            list.Save(writer);
+        }
+    }
+
+    static PartitionedPostings Open(SnapshotReader& reader, size_t partition_count) {
+        PartitionedPostings postings;
+        const uint64_t list_count = reader.Read<uint64_t>();
+        if (list_count > partition_count) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        postings.lists_.reserve(list_count);
+        for (uint64_t i = 0; i < list_count; ++i) {
+            const uint64_t partition = reader.Read<uint64_t>();
+            if (partition >= partition_count || postings.Get(partition).size() > 0) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+            postings.lists_.emplace_back(static_cast<uint8_t>(partition), List::Open(reader));
+            if (postings.lists_.back().second.size() == 0) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+        }
+        return postings;
+    }
+
+private:
+    static inline const List EMPTY_LIST{};
+
+    std::vector<std::pair<uint8_t, List>> lists_;
+};
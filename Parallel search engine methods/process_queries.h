@@ -1,5 +1,6 @@
 #pragma once
 #include "search_server.h"
+#include "thread_pool.h"
 
 #include <algorithm>
 #include <cmath>
@@ -14,6 +15,15 @@
 #include <functional>
 #include <execution>
 #include <list>
+#include <numeric>
+
+// Queries handed out per worker at a time
+const size_t QUERY_CHUNK_SIZE = 8;
+// Queries evaluated together by ProcessQueriesBatched. Larger batches share more
+// posting scans, but keep the accumulators of every query in memory at once
+const size_t QUERY_BATCH_SIZE = 1024;
+// Queries whose results StreamQueriesJoined holds at a time
+const size_t QUERY_WINDOW_SIZE = 1024;
 
 std::vector<std::vector<Document>> ProcessQueries(
     const SearchServer& search_server,
@@ -21,21 +31,152 @@ std::vector<std::vector<Document>> ProcessQueries(
 {
     std::vector<std::vector<Document>> answ;
     answ.resize(queries.size());
-    std::transform(std::execution::par, queries.begin(), queries.end(), answ.begin(), [&search_server] (std::string hlp){
-                   return search_server.FindTopDocuments(hlp);});
+    std::transform(std::execution::par, queries.begin(), queries.end(), answ.begin(), [&search_server] (const std::string& query){
+                   return search_server.FindTopDocuments(query);});
+    return answ;
+}
+
+// Runs the queries on a pool that outlives the call. Batches of up to chunk_size queries stay on the calling thread
+std::vector<std::vector<Document>> ProcessQueries(
+    ThreadPool& thread_pool,
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    size_t chunk_size = QUERY_CHUNK_SIZE)
+{
+    std::vector<std::vector<Document>> answ(queries.size());
+    thread_pool.ParallelFor(queries.size(), chunk_size, [&](size_t i) {
+        answ[i] = search_server.FindTopDocuments(queries[i]);
+    });
     return answ;
 }
 
+// Where the documents of every query start in the joined vector; the last offset is its size
+std::vector<size_t> GetJoinedOffsets(const std::vector<std::vector<Document>>& documents)
+{
+    std::vector<size_t> offsets(documents.size() + 1, 0);
+    std::transform_inclusive_scan(documents.begin(), documents.end(), offsets.begin() + 1, std::plus<>(),
+                                  [] (const std::vector<Document>& query_documents){ return query_documents.size(); });
+    return offsets;
+}
+
+// The joined vector is allocated once at its exact size, from the prefix sums of the counts of
+// the queries, and the documents of every query are then moved into place in parallel
 std::vector<Document> ProcessQueriesJoined(
     const SearchServer& search_server,
     const std::vector<std::string>& queries)
 {
-    std::vector<std::vector<Document>> hlp = ProcessQueries(search_server, queries);
- 
-    std::vector<Document> answ;
-    for (const auto& h : hlp)
+    std::vector<std::vector<Document>> documents = ProcessQueries(search_server, queries);
+    const std::vector<size_t> offsets = GetJoinedOffsets(documents);
+    std::vector<Document> answ(offsets.back());
+    std::vector<size_t> query_indexes(queries.size());
+    std::iota(query_indexes.begin(), query_indexes.end(), 0);
+    std::for_each(std::execution::par, query_indexes.begin(), query_indexes.end(), [&] (size_t i){
+                  std::move(documents[i].begin(), documents[i].end(), answ.begin() + offsets[i]);});
+    return answ;
+}
+
+std::vector<Document> ProcessQueriesJoined(
+    ThreadPool& thread_pool,
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    size_t chunk_size = QUERY_CHUNK_SIZE)
+{
+    std::vector<std::vector<Document>> documents = ProcessQueries(thread_pool, search_server, queries, chunk_size);
+    const std::vector<size_t> offsets = GetJoinedOffsets(documents);
+    std::vector<Document> answ(offsets.back());
+    thread_pool.ParallelFor(queries.size(), chunk_size, [&](size_t i) {
+        std::move(documents[i].begin(), documents[i].end(), answ.begin() + offsets[i]);
+    });
+    return answ;
+}
+
+// Passes the documents of every query to sink in query order instead of collecting them.
+// Queries are evaluated in parallel a window at a time, so only the results of one window are held
+template <typename DocumentSink>
+void StreamQueriesJoined(
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    DocumentSink sink,
+    size_t window_size = QUERY_WINDOW_SIZE)
+{
+    window_size = std::max<size_t>(window_size, 1);
+    std::vector<std::vector<Document>> window(std::min(window_size, queries.size()));
+    for (size_t begin = 0; begin < queries.size(); begin += window_size)
+    {
+        const size_t end = std::min(queries.size(), begin + window_size);
+        std::transform(std::execution::par, queries.begin() + begin, queries.begin() + end, window.begin(), [&search_server] (const std::string& query){
+                       return search_server.FindTopDocuments(query);});
+        for (size_t i = 0; i < end - begin; ++i)
+        {
+            for (const Document& document : window[i])
+            {
+                sink(document);
+            }
+        }
+    }
+}
+
+template <typename DocumentSink>
+void StreamQueriesJoined(
+    ThreadPool& thread_pool,
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    DocumentSink sink,
+    size_t window_size = QUERY_WINDOW_SIZE,
+    size_t chunk_size = QUERY_CHUNK_SIZE)
+{
+    window_size = std::max<size_t>(window_size, 1);
+    std::vector<std::vector<Document>> window(std::min(window_size, queries.size()));
+    for (size_t begin = 0; begin < queries.size(); begin += window_size)
     {
-        answ.insert(answ.end(), h.begin(), h.end());
+        const size_t end = std::min(queries.size(), begin + window_size);
+        thread_pool.ParallelFor(end - begin, chunk_size, [&](size_t i) {
+            window[i] = search_server.FindTopDocuments(queries[begin + i]);
+        });
+        for (size_t i = 0; i < end - begin; ++i)
+        {
+            for (const Document& document : window[i])
+            {
+                sink(document);
+            }
+        }
     }
+}
+
+// Same results as ProcessQueries. Queries are evaluated in batches of batch_size that share
+// their posting scans, which pays off when the queries have many words in common
+std::vector<std::vector<Document>> ProcessQueriesBatched(
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    size_t batch_size = QUERY_BATCH_SIZE)
+{
+    batch_size = std::max<size_t>(batch_size, 1);
+    std::vector<std::vector<Document>> answ;
+    answ.reserve(queries.size());
+    for (size_t begin = 0; begin < queries.size(); begin += batch_size)
+    {
+        const size_t end = std::min(queries.size(), begin + batch_size);
+        for (auto& documents : search_server.FindTopDocumentsBatch(queries.begin() + begin, queries.begin() + end))
+        {
+            answ.push_back(std::move(documents));
+        }
+    }
+    return answ;
+}
+
+std::vector<std::vector<Document>> ProcessQueriesBatched(
+    ThreadPool& thread_pool,
+    const SearchServer& search_server,
+    const std::vector<std::string>& queries,
+    size_t batch_size = QUERY_BATCH_SIZE)
+{
+    batch_size = std::max<size_t>(batch_size, 1);
+    std::vector<std::vector<Document>> answ(queries.size());
+    thread_pool.ParallelFor((queries.size() + batch_size - 1) / batch_size, 1, [&](size_t batch) {
+        const size_t begin = batch * batch_size;
+        const size_t end = std::min(queries.size(), begin + batch_size);
+        auto documents = search_server.FindTopDocumentsBatch(queries.begin() + begin, queries.begin() + end);
+        std::move(documents.begin(), documents.end(), answ.begin() + begin);
+    });
     return answ;
 }
@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+
+// Scratch memory for the temporaries of a query, one arena per thread, reused from query to query.
+// Allocation bumps an offset in a buffer and deallocation does nothing: a Scope takes back
+// everything allocated in it at once when it ends. Scopes nest, so a thread that picks up another
+// query while it waits inside a parallel algorithm keeps the memory of the first one.
+// What does not fit is taken from the heap, and the buffer grows to fit it at the next
+// outermost scope, so once the workload settles queries do not call malloc.
+// Memory of an arena must only be allocated by its own thread
+class QueryArena final : public std::pmr::memory_resource {
+public:
+    static constexpr size_t INITIAL_CAPACITY = 64 * 1024;
+
+    class Scope {
+    public:
+        Scope()
+            : arena_(ForThisThread())
+            , saved_offset_(arena_.Enter()) {
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            arena_.Leave(saved_offset_);
+        }
+
+        std::pmr::memory_resource* GetResource() const {
+            return &arena_;
+        }
+
+    private:
+        QueryArena& arena_;
+        size_t saved_offset_;
+    };
+
+    static QueryArena& ForThisThread() {
+        thread_local QueryArena arena;
+        return arena;
+    }
+
+private:
+    size_t Enter() {
+        if (depth_++ == 0 && wanted_capacity_ > capacity_) {
+            buffer_ = std::make_unique<std::byte[]>(wanted_capacity_);
+            capacity_ = wanted_capacity_;
+        }
+        return offset_;
+    }
+
+    void Leave(size_t saved_offset) {
+        offset_ = saved_offset;
+        --depth_;
+    }
+
+    bool Owns(const void* p) const {
+        const std::byte* byte = static_cast<const std::byte*>(p);
+        return buffer_ && buffer_.get() <= byte && byte < buffer_.get() + capacity_;
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        const uintptr_t base = reinterpret_cast<uintptr_t>(buffer_.get());
+        const size_t begin = ((base + offset_ + alignment - 1) & ~(uintptr_t{alignment} - 1)) - base;
+        if (buffer_ && begin + bytes <= capacity_) {
+            offset_ = begin + bytes;
+            return buffer_.get() + begin;
+        }
+        wanted_capacity_ = std::max(wanted_capacity_, 2 * (offset_ + bytes + alignment));
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        if (!Owns(p)) {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::unique_ptr<std::byte[]> buffer_;
+    size_t capacity_ = 0;
+    size_t offset_ = 0;
+    size_t depth_ = 0;
+    size_t wanted_capacity_ = INITIAL_CAPACITY;
+};
@@ -0,0 +1,123 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+struct QueryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Bounded cache of query results that drops the least recently used entry when full.
+// Every entry belongs to the index generation it was computed for; the first access
+// with a newer generation forgets them all. A copy starts empty with the same capacity.
+// Lookups may be of any type that Hash accepts and Key compares equal to; a Key is built
+// from one only when it is inserted
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class QueryCache {
+public:
+    QueryCache() = default;
+
+    QueryCache(const QueryCache& other)
+        : capacity_(other.GetCapacity()) {
+    }
+
+    QueryCache& operator=(const QueryCache&) = delete;
+
+    size_t GetCapacity() const {
+        return capacity_.load(std::memory_order_relaxed);
+    }
+
+    // Zero turns the cache off
+    void SetCapacity(size_t capacity) {
+        std::lock_guard lock(mutex_);
+        capacity_.store(capacity, std::memory_order_relaxed);
+        entries_.clear();
+        positions_.clear();
+    }
+
+    template <typename Lookup>
+    std::optional<Value> Find(const Lookup& key, uint64_t generation) {
+        const size_t hash = Hash{}(key);
+        std::lock_guard lock(mutex_);
+        Refresh(generation);
+        const auto it = FindPosition(key, hash);
+        if (it == positions_.end()) {
+            ++stats_.misses;
+            return std::nullopt;
+        }
+        ++stats_.hits;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->value;
+    }
+
+    template <typename Lookup>
+    void Insert(const Lookup& key, uint64_t generation, Value value) {
+        const size_t hash = Hash{}(key);
+        std::lock_guard lock(mutex_);
+        Refresh(generation);
+        if (GetCapacity() == 0 || FindPosition(key, hash) != positions_.end()) {
+            return;
+        }
+        if (entries_.size() == GetCapacity()) {
+            const auto last = std::prev(entries_.end());
+            const auto [first_position, last_position] = positions_.equal_range(last->hash);
+            positions_.erase(std::find_if(first_position, last_position, [last](const auto& position) {
+                return position.second == last;
+            }));
+            entries_.pop_back();
+        }
+        entries_.push_front(Entry{Key(key), hash, std::move(value)});
+        positions_.emplace(hash, entries_.begin());
+    }
+
+    QueryCacheStats GetStats() const {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        size_t hash;
+        Value value;
+    };
+    // Entries by the hash of their key
+    using Positions = std::unordered_multimap<size_t, typename std::list<Entry>::iterator>;
+
+    template <typename Lookup>
+    typename Positions::iterator FindPosition(const Lookup& key, size_t hash) {
+        const auto [first, last] = positions_.equal_range(hash);
+        for (auto it = first; it != last; ++it) {
+            if (it->second->key == key) {
+                return it;
+            }
+        }
+        return positions_.end();
+    }
+
+    void Refresh(uint64_t generation) {
+        if (generation != generation_) {
+            entries_.clear();
+            positions_.clear();
+            generation_ = generation;
+        }
+    }
+
+    mutable std::mutex mutex_;
+    // Read without the lock, so a disabled cache costs queries nothing
+    std::atomic<size_t> capacity_{0};
+    uint64_t generation_ = 0;
+    // The most recently used entry first
+    std::list<Entry> entries_;
+    Positions positions_;
+    QueryCacheStats stats_;
+};
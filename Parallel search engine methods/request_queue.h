@@ -35,9 +35,7 @@ public:
     }
  
     std::vector<Document> AddFindRequest(const std::string& raw_query, DocumentStatus status) {
-        return AddFindRequest(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-            return document_status == status;
-        });
+        return AddFindRequest(raw_query, StatusEquals{status});
     }
  
     std::vector<Document> AddFindRequest(const std::string& raw_query) {
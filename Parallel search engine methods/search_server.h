@@ -1,20 +1,59 @@
 #pragma once
+#include "compressed_postings.h"
+#include "concurrent_map.h"
 #include "document.h"
+#include "forward_index.h"
+#include "posting_list.h"
+#include "query_arena.h"
+#include "query_cache.h"
+#include "snapshot_file.h"
+#include "sorted_sets.h"
 #include "string_processing.h"
+#include "term_dictionary.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <cmath>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <set>
 #include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 #include <queue>
+#include <execution>
 #include <string_view>
+#include <type_traits>
+#include <unordered_map>
 
-const int MAX_RESULT_DOCUMENT_COUNT = 5;
+const size_t MAX_RESULT_DOCUMENT_COUNT = 5;
+const size_t RELEVANCE_BUCKET_COUNT = 100;
+// Accumulator slots FindTopDocumentsBatch keeps for all queries of a batch at once
+const size_t BATCH_ACCUMULATOR_COUNT = 1 << 18;
+const size_t BATCH_MIN_RANGE_SIZE = 256;
+// Documents AddDocuments splits into words as one task
+const size_t ADD_DOCUMENTS_CHUNK_SIZE = 1024;
+// Groups of terms whose posting lists AddDocuments fills as separate tasks
+const size_t ADD_DOCUMENTS_TERM_GROUP_COUNT = 64;
+// Removed documents keep their slots in the per-document tables until they take this share of
+// the slots; the remaining documents are then renumbered densely
+const double MAX_REMOVED_DOCUMENT_SHARE = 0.25;
+// Candidate documents or postings a query goes through between checks of its deadline and cancellation
+const size_t LIMIT_CHECK_INTERVAL = 1024;
+// Relevances closer than this are considered equal and ordered by rating
+const double RELEVANCE_EPSILON = 1e-6;
 
 enum class DocumentStatus {
     ACTUAL,
@@ -23,233 +62,1005 @@ enum class DocumentStatus {
     REMOVED,
 };
 
+// Predicates that FindTopDocuments recognizes at compile time and evaluates
+// through the index layout instead of a call per posting.
+// Any other callable taking (document_id, status, rating) still works
+struct StatusEquals {
+    DocumentStatus status;
+};
+
+// Both bounds are inclusive
+struct RatingBetween {
+    int min_rating;
+    int max_rating;
+};
+
+struct DocumentIdIn {
+    std::vector<int> document_ids;
+};
+
+// COMPRESSED bit-packs posting lists in blocks, trading some query speed for memory
+enum class IndexFormat {
+    PLAIN,
+    COMPRESSED,
+};
+
+// One of the documents given to SearchServer::AddDocuments
+struct DocumentToAdd {
+    int id;
+    std::string_view text;
+    DocumentStatus status;
+    std::vector<int> ratings;
+};
+
+// ANY_WORD finds documents with at least one plus word of the query, ALL_WORDS only those with every one
+enum class QueryMode {
+    ANY_WORD,
+    ALL_WORDS,
+};
+
+// Lets the caller give up on asynchronous queries. Copies share the same flag
+class CancellationToken {
+public:
+    void Cancel() const {
+        cancelled_->store(true, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_->load(std::memory_order_relaxed);
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> cancelled_ = std::make_shared<std::atomic<bool>>(false);
+};
+
+struct QueryLimits {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    CancellationToken cancellation;
+};
+
+// Delivered through the future of a query that was cancelled or missed its deadline
+class QueryAbandoned : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Document counts of a collection that a server holds only part of, such as one segment of a larger index.
+// A server given them computes IDF over the whole collection, so the relevances of its documents
+// can be compared with those of the other parts. The generation must change whenever the counts do
+// and is never zero
+class CollectionStatistics {
+public:
+    virtual ~CollectionStatistics() = default;
+
+    virtual size_t GetDocumentCount() const = 0;
+    virtual size_t GetDocumentFreq(std::string_view word) const = 0;
+    virtual uint64_t GetGeneration() const = 0;
+};
+
 class SearchServer {
 public:
     template <typename StringContainer>
-    SearchServer(const StringContainer& stop_words)
+    SearchServer(const StringContainer& stop_words, IndexFormat index_format = IndexFormat::PLAIN)
         : stop_words_(MakeUniqueNonEmptyStrings(stop_words))  // Extract non-empty stop words
+        , index_format_(index_format)
     {
         if (!all_of(stop_words_.begin(), stop_words_.end(), IsValidWord)) {
             throw std::invalid_argument("Some of stop words are invalid");
         }
     }
     
-    SearchServer(const std::string& stop_words_text)
-        : SearchServer(SplitIntoWords(stop_words_text))  // Invoke delegating constructor
-                                                         // from string container
+    SearchServer(const std::string& stop_words_text, IndexFormat index_format = IndexFormat::PLAIN)
+        : SearchServer(SplitIntoWords(stop_words_text), index_format)  // Invoke delegating constructor
+                                                                       // from string container
     {
     }
     
     void AddDocument(int document_id, const std::string_view& document, DocumentStatus status, const std::vector<int>& ratings) {
-        if ((document_id < 0) || (documents_.count(document_id) > 0)) {
+        if ((document_id < 0) || (document_indexes_.count(document_id) > 0)) {
             throw std::invalid_argument("Invalid document_id");
         }
-        const auto words = SplitIntoWordsNoStop(static_cast<std::string>(document));
+        const auto words = SplitIntoWordsNoStop(document);
 
         const double inv_word_count = 1.0 / words.size();
-        for (const std::string& word : words) {
-            word_to_document_freqs_[word][document_id] += inv_word_count;
+        std::vector<TermFreq> term_freqs;
+        term_freqs.reserve(words.size());
+        for (const std::string_view word : words) {
+            term_freqs.push_back({terms_.Intern(word), inv_word_count});
         }
-        documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
-        document_ids_.push_back(document_id);
+        MergeTermFreqs(term_freqs);
+        IndexDocument(document_id, term_freqs, inv_word_count, status, ComputeAverageRating(ratings));
     }
 
-    template <typename DocumentPredicate>
-    std::vector<Document> FindTopDocuments(const std::string_view& raw_query, DocumentPredicate document_predicate) const {
-        std::string str{raw_query};
-        const auto query = ParseQuery(str);
+    // Adds a document of another server as if it were added here with the same text and ratings.
+    // The servers are expected to have the same stop words
+    void AddDocument(const SearchServer& source, int document_id) {
+        if ((document_id < 0) || (document_indexes_.count(document_id) > 0)) {
+            throw std::invalid_argument("Invalid document_id");
+        }
+        const DocumentIndex source_index = source.document_indexes_.at(document_id);
+        const double inv_word_count = source.document_inv_word_counts_[source_index];
+        std::vector<TermFreq> term_freqs;
+        source.forward_index_.ForEach(source_index, [&](TermId term, uint32_t term_count) {
+            term_freqs.push_back({terms_.Intern(source.terms_.GetTerm(term)), GetTermFreq(term_count, inv_word_count)});
+        });
+        MergeTermFreqs(term_freqs);
+        IndexDocument(document_id, term_freqs, inv_word_count, source.document_statuses_[source_index], source.document_ratings_[source_index]);
+    }
 
-        auto matched_documents = FindAllDocuments(query, document_predicate);
+    // Adds a random-access range of DocumentToAdd, with the same result as AddDocument for each in turn.
+    // Under a parallel policy, chunks of documents are split into words at once, each against a
+    // dictionary of its own; the chunk dictionaries are then merged into the server's, and every
+    // group of terms gets its postings from all chunks in a task of its own.
+    // Ids and words are checked before anything changes, so an invalid one adds no documents,
+    // and a failure after that takes back the documents added so far
+    template <typename ExecutionPolicy, typename DocumentRange>
+    void AddDocuments(ExecutionPolicy&& policy, const DocumentRange& documents) {
+        const auto first = std::begin(documents);
+        const size_t document_count = std::size(documents);
 
-        sort(matched_documents.begin(), matched_documents.end(), [](const Document& lhs, const Document& rhs) {
-            if (abs(lhs.relevance - rhs.relevance) < 1e-6) {
-                return lhs.rating > rhs.rating;
-            } else {
-                return lhs.relevance > rhs.relevance;
+        std::vector<int> new_ids;
+        new_ids.reserve(document_count);
+        for (size_t i = 0; i < document_count; ++i) {
+            if ((first[i].id < 0) || (document_indexes_.count(first[i].id) > 0)) {
+                throw std::invalid_argument("Invalid document_id");
+            }
+            new_ids.push_back(first[i].id);
+        }
+        std::sort(new_ids.begin(), new_ids.end());
+        if (std::adjacent_find(new_ids.begin(), new_ids.end()) != new_ids.end()) {
+            throw std::invalid_argument("Invalid document_id");
+        }
+
+        struct Posting {
+            TermId term;
+            DocumentIndex document_index;
+            double term_freq;
+        };
+        // Terms of a chunk are numbered locally until the chunk dictionaries are merged
+        struct Chunk {
+            std::unordered_map<std::string_view, TermId> local_terms;
+            std::vector<std::string_view> words;
+            std::vector<TermId> global_terms;
+            std::array<std::vector<Posting>, ADD_DOCUMENTS_TERM_GROUP_COUNT> term_groups;
+            // Parallel algorithms terminate on exceptions, so they are passed on by hand
+            std::exception_ptr error;
+        };
+        std::vector<Chunk> chunks((document_count + ADD_DOCUMENTS_CHUNK_SIZE - 1) / ADD_DOCUMENTS_CHUNK_SIZE);
+        std::vector<size_t> chunk_indexes(chunks.size());
+        std::iota(chunk_indexes.begin(), chunk_indexes.end(), 0);
+        const auto for_each_document = [document_count](size_t chunk_index, auto action) {
+            for (size_t i = chunk_index * ADD_DOCUMENTS_CHUNK_SIZE; i < std::min(document_count, (chunk_index + 1) * ADD_DOCUMENTS_CHUNK_SIZE); ++i) {
+                action(i);
+            }
+        };
+
+        std::vector<std::vector<TermFreq>> term_freqs(document_count);
+        std::vector<double> inv_word_counts(document_count);
+        std::for_each(policy, chunk_indexes.begin(), chunk_indexes.end(), [&](size_t chunk_index) {
+            Chunk& chunk = chunks[chunk_index];
+            try {
+                for_each_document(chunk_index, [&](size_t i) {
+                    const auto words = SplitIntoWordsNoStop(first[i].text);
+                    inv_word_counts[i] = 1.0 / words.size();
+                    term_freqs[i].reserve(words.size());
+                    for (const std::string_view word : words) {
+                        const auto [it, inserted] = chunk.local_terms.emplace(word, static_cast<TermId>(chunk.words.size()));
+                        if (inserted) {
+                            chunk.words.push_back(word);
+                        }
+                        term_freqs[i].push_back({it->second, inv_word_counts[i]});
+                    }
+                });
+            } catch (...) {
+                chunk.error = std::current_exception();
             }
         });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+        for (const Chunk& chunk : chunks) {
+            if (chunk.error) {
+                std::rethrow_exception(chunk.error);
+            }
         }
 
-        return matched_documents;
+        for (Chunk& chunk : chunks) {
+            chunk.global_terms.reserve(chunk.words.size());
+            for (const std::string_view word : chunk.words) {
+                chunk.global_terms.push_back(terms_.Intern(word));
+            }
+        }
+        const DocumentIndex first_index = static_cast<DocumentIndex>(index_to_document_id_.size());
+        std::for_each(policy, chunk_indexes.begin(), chunk_indexes.end(), [&](size_t chunk_index) {
+            Chunk& chunk = chunks[chunk_index];
+            try {
+                for_each_document(chunk_index, [&](size_t i) {
+                    for (TermFreq& term_freq : term_freqs[i]) {
+                        term_freq.term = chunk.global_terms[term_freq.term];
+                    }
+                    MergeTermFreqs(term_freqs[i]);
+                    for (const auto [term, term_freq] : term_freqs[i]) {
+                        chunk.term_groups[term % ADD_DOCUMENTS_TERM_GROUP_COUNT].push_back({term, first_index + static_cast<DocumentIndex>(i), term_freq});
+                    }
+                });
+            } catch (...) {
+                chunk.error = std::current_exception();
+            }
+        });
+        for (const Chunk& chunk : chunks) {
+            if (chunk.error) {
+                std::rethrow_exception(chunk.error);
+            }
+        }
+
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            term_to_compressed_postings_.resize(terms_.size());
+        } else {
+            term_to_document_freqs_.resize(terms_.size());
+        }
+        idf_cache_.resize(terms_.size());
+        try {
+            for (size_t i = 0; i < document_count; ++i) {
+                forward_index_.AddDocument();
+                for (const auto [term, term_freq] : term_freqs[i]) {
+                    forward_index_.AddTerm(term, GetTermCount(term_freq, inv_word_counts[i]));
+                }
+            }
+            for (size_t i = 0; i < document_count; ++i) {
+                AddDocumentEntry(first[i].id, inv_word_counts[i], first[i].status, ComputeAverageRating(first[i].ratings));
+            }
+
+            // Every group appends to posting lists of its own, taking the chunks in document order
+            std::vector<size_t> term_groups(ADD_DOCUMENTS_TERM_GROUP_COUNT);
+            std::iota(term_groups.begin(), term_groups.end(), 0);
+            std::vector<std::exception_ptr> group_errors(ADD_DOCUMENTS_TERM_GROUP_COUNT);
+            std::for_each(policy, term_groups.begin(), term_groups.end(), [&](size_t term_group) {
+                try {
+                    for (Chunk& chunk : chunks) {
+                        for (const Posting& posting : chunk.term_groups[term_group]) {
+                            const size_t i = posting.document_index - first_index;
+                            AddPosting(posting.term, GetStatusPartition(first[i].status), posting.document_index, posting.term_freq,
+                                       GetTermCount(posting.term_freq, inv_word_counts[i]));
+                        }
+                        std::vector<Posting>().swap(chunk.term_groups[term_group]);
+                    }
+                } catch (...) {
+                    group_errors[term_group] = std::current_exception();
+                }
+            });
+            for (const std::exception_ptr& error : group_errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        } catch (...) {
+            DropDocumentsFrom(first_index);
+            throw;
+        }
+        ++index_generation_;
     }
 
-    std::vector<Document> FindTopDocuments(const std::string_view& raw_query, DocumentStatus status) const {
-        return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-            return document_status == status;
-        });
+    // IDF is then computed from the statistics instead of the documents of this server.
+    // They must outlive the server and be set before any query
+    void SetCollectionStatistics(const CollectionStatistics* collection_statistics) {
+        collection_statistics_ = collection_statistics;
+        for (CachedIdf& cached : idf_cache_) {
+            cached.generation.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Writes the index to a file that OpenSnapshot maps back without parsing or rebuilding it.
+    // An existing file is replaced only once the new one is complete
+    void SaveSnapshot(const std::string& path) const {
+        SnapshotWriter writer(path);
+        writer.Write(static_cast<uint32_t>(index_format_));
+        writer.WriteStrings(stop_words_);
+        terms_.Save(writer);
+        for (TermId term = 0; term < terms_.size(); ++term) {
+            if (index_format_ == IndexFormat::COMPRESSED) {
+                term_to_compressed_postings_[term].Save(writer);
+            } else {
+                term_to_document_freqs_[term].Save(writer);
+            }
+        }
+        writer.WriteArray(index_to_document_id_);
+        writer.WriteArray(document_ratings_);
+        writer.WriteArray(document_statuses_);
+        writer.WriteArray(document_inv_word_counts_);
+        forward_index_.Save(writer);
+        std::vector<DocumentIndex> live_indexes;
+        for (const auto [document_id, document_index] : document_indexes_) {
+            live_indexes.push_back(document_index);
+        }
+        std::sort(live_indexes.begin(), live_indexes.end());
+        writer.WriteArray(live_indexes);
+        writer.Finish();
+    }
+
+    // Posting lists, terms and the forward index stay in the mapped file and are read from it
+    // in place; only the id lookups are rebuilt. The server can be changed afterwards: a changed
+    // array is first copied out of the file. Throws std::runtime_error if the file is not a
+    // complete snapshot
+    static SearchServer OpenSnapshot(const std::string& path) {
+        auto file = std::make_shared<const MappedFile>(path);
+        SnapshotReader reader(*file);
+        const uint32_t index_format = reader.Read<uint32_t>();
+        if (index_format > static_cast<uint32_t>(IndexFormat::COMPRESSED)) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        SearchServer server(reader.ReadStrings(), static_cast<IndexFormat>(index_format));
+        server.snapshot_file_ = file;
+        server.terms_ = TermDictionary::Open(reader);
+        const size_t term_count = server.terms_.size();
+        if (server.index_format_ == IndexFormat::COMPRESSED) {
+            server.term_to_compressed_postings_.resize(term_count);
+        } else {
+            server.term_to_document_freqs_.resize(term_count);
+        }
+        for (TermId term = 0; term < term_count; ++term) {
+            if (server.index_format_ == IndexFormat::COMPRESSED) {
+                server.term_to_compressed_postings_[term] = PartitionedPostings<CompressedPostingList>::Open(reader, STATUS_COUNT);
+            } else {
+                server.term_to_document_freqs_[term] = PartitionedPostings<PostingList>::Open(reader, STATUS_COUNT);
+            }
+        }
+        server.idf_cache_.resize(term_count);
+
+        const auto read_vector = [&reader](auto& vector) {
+            using T = typename std::decay_t<decltype(vector)>::value_type;
+            const MappedArray<T> array = reader.ReadArray<T>();
+            vector.assign(array.begin(), array.end());
+        };
+        read_vector(server.index_to_document_id_);
+        read_vector(server.document_ratings_);
+        read_vector(server.document_statuses_);
+        read_vector(server.document_inv_word_counts_);
+        server.forward_index_ = ForwardIndex::Open(reader, term_count);
+        const size_t document_count = server.index_to_document_id_.size();
+        if (server.document_ratings_.size() != document_count || server.document_statuses_.size() != document_count
+            || server.document_inv_word_counts_.size() != document_count || server.forward_index_.GetDocumentCount() != document_count) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        for (const DocumentStatus status : server.document_statuses_) {
+            if (static_cast<size_t>(status) >= STATUS_COUNT) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+        }
+        for (const DocumentIndex document_index : reader.ReadArray<DocumentIndex>()) {
+            if (document_index >= document_count
+                || !server.document_indexes_.emplace(server.index_to_document_id_[document_index], document_index).second) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+            server.document_ids_.insert(server.index_to_document_id_[document_index]);
+        }
+        if (!reader.AtEnd()) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        return server;
+    }
+
+    // Returns at most max_document_count documents, the most relevant first
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const std::string_view& raw_query, DocumentPredicate document_predicate,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        return FindTopDocumentsWithin(policy, raw_query, document_predicate, max_document_count, query_mode, nullptr);
+    }
+
+    template <typename ExecutionPolicy>
+    std::vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const std::string_view& raw_query, DocumentStatus status,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        return FindTopDocuments(policy, raw_query, StatusEquals{status}, max_document_count, query_mode);
+    }
+
+    template <typename ExecutionPolicy>
+    std::vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const std::string_view& raw_query) const {
+        return FindTopDocuments(policy, raw_query, DocumentStatus::ACTUAL);
+    }
+
+    template <typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(const std::string_view& raw_query, DocumentPredicate document_predicate,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        return FindTopDocuments(std::execution::seq, raw_query, document_predicate, max_document_count, query_mode);
+    }
+
+    std::vector<Document> FindTopDocuments(const std::string_view& raw_query, DocumentStatus status,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        return FindTopDocuments(std::execution::seq, raw_query, status, max_document_count, query_mode);
     }
 
     std::vector<Document> FindTopDocuments(const std::string_view& raw_query) const {
-        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+        return FindTopDocuments(std::execution::seq, raw_query);
+    }
+
+    // Queues the query on the server's own worker threads, started on first use, and returns at once.
+    // A query that is cancelled or passes its deadline, before or while it runs, stops
+    // and its future throws QueryAbandoned. The server must outlive its pending queries
+    template <typename DocumentPredicate>
+    std::future<std::vector<Document>> FindTopDocumentsAsync(std::string raw_query, DocumentPredicate document_predicate,
+                                                             size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryLimits limits = {}) const {
+        auto task = std::make_shared<std::packaged_task<std::vector<Document>()>>(
+            [this, raw_query = std::move(raw_query), document_predicate = std::move(document_predicate), max_document_count, limits] {
+                CheckQueryLimits(&limits);
+                if constexpr (std::is_same_v<DocumentPredicate, DocumentStatus>) {
+                    return FindTopDocumentsWithin(std::execution::seq, raw_query, StatusEquals{document_predicate}, max_document_count,
+                                                  QueryMode::ANY_WORD, &limits);
+                } else {
+                    return FindTopDocumentsWithin(std::execution::seq, raw_query, document_predicate, max_document_count, QueryMode::ANY_WORD,
+                                                  &limits);
+                }
+            });
+        auto result = task->get_future();
+        async_executor_.Get().Submit([task] {
+            (*task)();
+        });
+        return result;
+    }
+
+    std::future<std::vector<Document>> FindTopDocumentsAsync(std::string raw_query) const {
+        return FindTopDocumentsAsync(std::move(raw_query), DocumentStatus::ACTUAL);
+    }
+
+    // Answers the queries in [first, last) as FindTopDocuments(query, status, max_document_count) would.
+    // The batch walks the posting lists of all its words together, a range of documents at a time:
+    // each list is scanned once for the whole batch, and every posting goes to the accumulators of all
+    // the queries with its word. Repeated queries are answered once
+    template <typename QueryIterator>
+    std::vector<std::vector<Document>> FindTopDocumentsBatch(QueryIterator first, QueryIterator last, DocumentStatus status = DocumentStatus::ACTUAL,
+                                                             size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        // The accumulators of a large batch would stay in the scratch arena for good, so the batch gets its own memory
+        std::pmr::monotonic_buffer_resource batch_memory;
+
+        std::pmr::vector<Query> queries(&batch_memory);
+        std::pmr::vector<size_t> raw_query_to_query(&batch_memory);
+        std::pmr::unordered_map<std::string_view, size_t> raw_query_indexes(&batch_memory);
+        for (auto it = first; it != last; ++it) {
+            const std::string_view raw_query = *it;
+            const auto [position, inserted] = raw_query_indexes.emplace(raw_query, queries.size());
+            if (inserted) {
+                queries.push_back(ParseQuery(raw_query, &batch_memory));
+            }
+            raw_query_to_query.push_back(position->second);
+        }
+
+        const auto top_documents = WithCursorType([&](auto make_cursor) {
+            return EvaluateBatch(queries, GetScannedStatuses(StatusEquals{status}), max_document_count, make_cursor, &batch_memory);
+        });
+        std::vector<std::vector<Document>> result;
+        result.reserve(raw_query_to_query.size());
+        for (const size_t query : raw_query_to_query) {
+            result.push_back(top_documents[query]);
+        }
+        return result;
+    }
+
+    // Keeps the results of the last capacity queries filtered by status or rating, so repeated
+    // queries are answered without evaluation. Any added or removed document invalidates them.
+    // Zero, the default, turns the cache off
+    void SetQueryCacheCapacity(size_t capacity) {
+        query_cache_.SetCapacity(capacity);
+    }
+
+    QueryCacheStats GetQueryCacheStats() const {
+        return query_cache_.GetStats();
     }
 
     int GetDocumentCount() const {
-        return documents_.size();
+        return document_indexes_.size();
+    }
+
+    bool HasDocument(int document_id) const {
+        return document_indexes_.count(document_id) > 0;
+    }
+
+    // Throws std::invalid_argument for the texts AddDocument rejects, with the same message
+    static void CheckDocumentText(std::string_view document) {
+        for (const std::string_view word : SplitIntoWords(document)) {
+            CheckDocumentWord(word);
+        }
     }
     
-    std::vector<int>::const_iterator begin() const{
+    std::set<int>::const_iterator begin() const{
         return document_ids_.begin();
     }
 
-    std::vector<int>::const_iterator end() const{
+    std::set<int>::const_iterator end() const{
         return document_ids_.end();
     }
     
     const std::map<std::string_view, double> GetWordFrequencies(int document_id) const {
-        std::map<std::string_view, double> answer;
-        bool next=false;
-        for(const auto& s:document_ids_)
-        {
-            if(s==document_id)
-            {next=true;}
-        }
-        if(next)
-        {
-            std::vector<std::string> k;
-            for(const auto& [x, z]:word_to_document_freqs_)
-            {
-                for(const auto& [zzz, _]:z)
-                {
-                    if(zzz==document_id)
-                    {
-                        k.push_back(x);
-                    }
-                }
-            }
-            for(const auto& f:k)
-            {
-                if(answer[f])
-                {
-                    ++answer[f];
-                }
-                else
-                {
-                    answer.insert(std::pair<std::string_view, double>(static_cast<std::string_view>(f), 1.0));
-                }
-            }
+        std::map<std::string_view, double> word_freqs;
+        const auto it = document_indexes_.find(document_id);
+        if (it != document_indexes_.end()) {
+            const double inv_word_count = document_inv_word_counts_[it->second];
+            forward_index_.ForEach(it->second, [&](TermId term, uint32_t term_count) {
+                word_freqs.emplace(terms_.GetTerm(term), GetTermFreq(term_count, inv_word_count));
+            });
         }
-        return answer;
+        return word_freqs;
     }
     
     std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(std::string_view raw_query, int document_id) const {
-            std::string str{raw_query};
-            Query query = ParseQuery(str);
+            const QueryArena::Scope scratch;
+            const Query query = ParseQuery(raw_query, scratch.GetResource());
+            const DocumentIndex document_index = document_indexes_.at(document_id);
+            const size_t partition = GetStatusPartition(document_statuses_[document_index]);
  
             std::vector<std::string_view> matched_words;
-            for (const std::string& word : query.plus_words) {
-                if (word_to_document_freqs_.count(word) == 0) {
-                    continue;
-                }
-                if (word_to_document_freqs_.at(word).count(document_id)) {
-                    matched_words.push_back(static_cast<std::string_view>(word));
+            for (const TermId term : query.plus_terms) {
+                if (HasPosting(term, partition, document_index)) {
+                    matched_words.push_back(terms_.GetTerm(term));
                 }
             }
-            for (const std::string& word : query.minus_words) {
-                if (word_to_document_freqs_.count(word) == 0) {
-                    continue;
-                }
-                if (word_to_document_freqs_.at(word).count(document_id)) {
+            for (const TermId term : query.minus_terms) {
+                if (HasPosting(term, partition, document_index)) {
                     matched_words.clear();
                     break;
                 }
             }
-            return {matched_words, documents_.at(document_id).status};
+            // Term ids follow the order of interning; the words are returned sorted, as by the policy overload
+            std::sort(matched_words.begin(), matched_words.end());
+            return {matched_words, document_statuses_[document_index]};
     }
     
     template <typename Execution>
     std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(Execution&& policy, std::string_view raw_query, int document_id) const {
-            std::string str{raw_query};
-            Query query = ParseQuery(str);
-    
-            std::vector<std::string_view> matched_words;
-            for (const std::string& word : query.plus_words) {
-                if (word_to_document_freqs_.count(word) == 0) {
-                    continue;
-                }
-                if (word_to_document_freqs_.at(word).count(document_id)) {
-                    matched_words.push_back(static_cast<std::string_view>(word));
-                }
+            // Duplicates are cheaper to drop from the matched words than from the query
+            const QueryArena::Scope scratch;
+            const Query query = ParseQuery(raw_query, scratch.GetResource(), false);
+            const DocumentIndex document_index = document_indexes_.at(document_id);
+            const DocumentStatus status = document_statuses_[document_index];
+            const size_t partition = GetStatusPartition(status);
+
+            if (std::any_of(policy, query.minus_terms.begin(), query.minus_terms.end(), [this, document_index, partition](TermId term) {
+                    return HasPosting(term, partition, document_index);
+                })) {
+                return {std::vector<std::string_view>{}, status};
             }
-            for (const std::string& word : query.minus_words) {
-                if (word_to_document_freqs_.count(word) == 0) {
-                    continue;
-                }
-                if (word_to_document_freqs_.at(word).count(document_id)) {
-                    matched_words.clear();
-                    break;
-                }
+
+            std::vector<std::string_view> matched_words(query.plus_terms.size());
+            std::transform(policy, query.plus_terms.begin(), query.plus_terms.end(), matched_words.begin(), [this, document_index, partition](TermId term) {
+                return HasPosting(term, partition, document_index) ? terms_.GetTerm(term) : std::string_view{};
+            });
+            std::sort(policy, matched_words.begin(), matched_words.end());
+            matched_words.erase(std::unique(matched_words.begin(), matched_words.end()), matched_words.end());
+            // Words missing from the document were mapped to an empty view, which sorts first
+            if (!matched_words.empty() && matched_words.front().empty()) {
+                matched_words.erase(matched_words.begin());
             }
-            return {matched_words, documents_.at(document_id).status};
+            return {matched_words, status};
     }
     
     void RemoveDocument(int document_id)
     {
-        int i=0;
-        for(const auto& id:document_ids_)
-        {
-            if(id==document_id)
-            {
-                break;
-            }
-            i++;
+        const auto it = document_indexes_.find(document_id);
+        if (it == document_indexes_.end()) {
+            return;
         }
-        document_ids_.erase(document_ids_.begin()+i);
-        for(auto& [x, z]:word_to_document_freqs_)
-        {
-            z.erase(document_id);
-        }
-        documents_.erase(document_id);
+        const DocumentIndex document_index = it->second;
+        const size_t partition = GetStatusPartition(document_statuses_[document_index]);
+        forward_index_.ForEach(document_index, [&](TermId term, uint32_t) {
+            RemovePosting(term, partition, document_index);
+        });
+        ReleaseDocumentIndex(it);
     }
     
     template <typename Execution>
-    void RemoveDocument(const Execution&, int document_id)
+    void RemoveDocument(Execution&& policy, int document_id)
     {
-        int i=0;
-        for(const auto& id:document_ids_)
-        {
-            if(id==document_id)
-            {
-                break;
+        const auto it = document_indexes_.find(document_id);
+        if (it == document_indexes_.end()) {
+            return;
+        }
+        const DocumentIndex document_index = it->second;
+        const size_t partition = GetStatusPartition(document_statuses_[document_index]);
+        std::vector<TermId> terms;
+        forward_index_.ForEach(document_index, [&terms](TermId term, uint32_t) {
+            terms.push_back(term);
+        });
+        // Every term owns a separate posting list, so they can be updated concurrently
+        std::for_each(policy, terms.begin(), terms.end(), [this, document_index, partition](TermId term) {
+            RemovePosting(term, partition, document_index);
+        });
+        ReleaseDocumentIndex(it);
+    }
+
+private:
+    // Postings of a term are partitioned by the status of their documents
+    static constexpr size_t STATUS_COUNT = 4;
+    using StatusSet = std::bitset<STATUS_COUNT>;
+    static inline const StatusSet ALL_STATUSES = StatusSet{}.set();
+
+    // DocumentIdIn translated to sorted indexes of the documents that exist
+    struct DocumentIndexSet {
+        std::pmr::vector<DocumentIndex> indexes;
+    };
+    struct TermFreq {
+        TermId term;
+        double term_freq;
+    };
+
+    const std::set<std::string, std::less<>> stop_words_;
+    // Terms are never forgotten, so their ids stay valid after the documents are removed
+    TermDictionary terms_;
+    const IndexFormat index_format_;
+    // Only the storage of index_format_ is used
+    std::vector<PartitionedPostings<PostingList>> term_to_document_freqs_;
+    // Compressed postings keep term counts; multiplied by the inverse word count they give term frequencies
+    std::vector<PartitionedPostings<CompressedPostingList>> term_to_compressed_postings_;
+    std::unordered_map<int, DocumentIndex> document_indexes_;
+    std::set<int> document_ids_;
+    // Per-document tables indexed by DocumentIndex
+    std::vector<int> index_to_document_id_;
+    std::vector<int> document_ratings_;
+    std::vector<DocumentStatus> document_statuses_;
+    std::vector<double> document_inv_word_counts_;
+    // Terms of every document with their counts
+    ForwardIndex forward_index_;
+    // Keeps the arrays that were opened from a snapshot and are still read from it
+    std::shared_ptr<const MappedFile> snapshot_file_;
+
+    // Every added or removed document changes the document count and thus every IDF,
+    // so a single counter tells whether a cached IDF is still valid
+    uint64_t index_generation_ = 1;
+    const CollectionStatistics* collection_statistics_ = nullptr;
+    struct CachedIdf {
+        std::atomic<uint64_t> generation{0};
+        std::atomic<double> value{0.0};
+
+        CachedIdf() = default;
+        CachedIdf(const CachedIdf& other)
+            : generation(other.generation.load())
+            , value(other.value.load()) {
+        }
+    };
+    // Filled lazily by concurrent queries, hence the atomics
+    mutable std::vector<CachedIdf> idf_cache_;
+
+    // The parsed query, sorted and without repeats, with everything else its result depends on.
+    // A lookup views the terms in the scratch arena of the query, so a hit allocates nothing
+    struct QueryCacheLookup {
+        const TermId* plus_terms;
+        size_t plus_term_count;
+        const TermId* minus_terms;
+        size_t minus_term_count;
+        // Predicate tag and its arguments, query mode, has_unindexed_plus_words and max_document_count
+        std::array<int64_t, 6> options;
+    };
+    // What the cache keeps of a lookup it inserts
+    struct QueryCacheKey {
+        explicit QueryCacheKey(const QueryCacheLookup& lookup)
+            : plus_term_count(lookup.plus_term_count)
+            , options(lookup.options) {
+            terms.reserve(lookup.plus_term_count + lookup.minus_term_count);
+            terms.insert(terms.end(), lookup.plus_terms, lookup.plus_terms + lookup.plus_term_count);
+            terms.insert(terms.end(), lookup.minus_terms, lookup.minus_terms + lookup.minus_term_count);
+        }
+
+        bool operator==(const QueryCacheLookup& lookup) const {
+            return plus_term_count == lookup.plus_term_count && terms.size() == plus_term_count + lookup.minus_term_count
+                   && std::equal(lookup.plus_terms, lookup.plus_terms + lookup.plus_term_count, terms.begin())
+                   && std::equal(lookup.minus_terms, lookup.minus_terms + lookup.minus_term_count, terms.begin() + plus_term_count)
+                   && options == lookup.options;
+        }
+
+        // The plus terms followed by the minus terms
+        std::vector<TermId> terms;
+        size_t plus_term_count;
+        std::array<int64_t, 6> options;
+    };
+    struct QueryCacheKeyHash {
+        size_t operator()(const QueryCacheLookup& key) const {
+            uint64_t hash = key.plus_term_count;
+            const auto mix = [&hash](uint64_t value) {
+                hash = (hash ^ value) * 0x100000001B3ull;
+            };
+            std::for_each(key.plus_terms, key.plus_terms + key.plus_term_count, mix);
+            mix(key.minus_term_count);
+            std::for_each(key.minus_terms, key.minus_terms + key.minus_term_count, mix);
+            for (const int64_t option : key.options) {
+                mix(static_cast<uint64_t>(option));
             }
-            i++;
+            return static_cast<size_t>(hash);
         }
-        document_ids_.erase(document_ids_.begin()+i);
-        for(auto& [x, z]:word_to_document_freqs_)
-        {
-            z.erase(document_id);
+    };
+    mutable QueryCache<QueryCacheKey, std::vector<Document>, QueryCacheKeyHash> query_cache_;
+
+    // Worker threads of the asynchronous queries. A copy of the server gets threads of its own
+    class AsyncExecutor {
+    public:
+        AsyncExecutor() = default;
+
+        AsyncExecutor(const AsyncExecutor&)
+            : AsyncExecutor() {
         }
-        documents_.erase(document_id);
+
+        AsyncExecutor& operator=(const AsyncExecutor&) {
+            return *this;
+        }
+
+        ThreadPool& Get() {
+            std::call_once(started_, [this] {
+                thread_pool_ = std::make_unique<ThreadPool>(std::max(1u, std::thread::hardware_concurrency()));
+            });
+            return *thread_pool_;
+        }
+
+    private:
+        std::once_flag started_;
+        std::unique_ptr<ThreadPool> thread_pool_;
+    };
+
+    static size_t GetStatusPartition(DocumentStatus status) {
+        return static_cast<size_t>(status);
     }
 
-private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
+    size_t GetPostingCount(TermId term, size_t partition) const {
+        return index_format_ == IndexFormat::COMPRESSED ? term_to_compressed_postings_[term].Get(partition).size()
+                                                        : term_to_document_freqs_[term].Get(partition).size();
+    }
+
+    size_t GetDocumentFreq(TermId term) const {
+        size_t document_freq = 0;
+        for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+            document_freq += GetPostingCount(term, partition);
+        }
+        return document_freq;
+    }
+
+    void AddPosting(TermId term, size_t partition, DocumentIndex document_index, double term_freq, uint32_t term_count) {
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            term_to_compressed_postings_[term].Change(partition, [&](CompressedPostingList& postings) {
+                postings.Add(document_index, term_count, term_freq);
+            });
+        } else {
+            term_to_document_freqs_[term].Change(partition, [&](PostingList& postings) {
+                postings.Add(document_index, term_freq);
+            });
+        }
+    }
+
+    bool HasPosting(TermId term, size_t partition, DocumentIndex document_index) const {
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            return term_to_compressed_postings_[term].Get(partition).FindTermCount(document_index) > 0;
+        }
+        return term_to_document_freqs_[term].Get(partition).Contains(document_index);
+    }
+
+    void RemovePosting(TermId term, size_t partition, DocumentIndex document_index) {
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            term_to_compressed_postings_[term].Change(partition, [document_index](CompressedPostingList& postings) {
+                postings.Remove(document_index);
+            });
+        } else {
+            term_to_document_freqs_[term].Change(partition, [document_index](PostingList& postings) {
+                postings.Remove(document_index);
+            });
+        }
+    }
+
+    // Cursor over compressed postings that turns term counts back into term frequencies
+    class CompressedTermCursor {
+    public:
+        CompressedTermCursor(const CompressedPostingList& postings, const std::vector<double>& inv_word_counts)
+            : cursor_(postings)
+            , inv_word_counts_(&inv_word_counts) {
+        }
+
+        DocumentIndex Document() const {
+            return cursor_.Document();
+        }
+
+        double TermFreq() const {
+            return cursor_.TermCount() * (*inv_word_counts_)[cursor_.Document()];
+        }
+
+        void Seek(DocumentIndex target) {
+            cursor_.Seek(target);
+        }
+
+        void Next() {
+            cursor_.Next();
+        }
+
+        double GetMaxTermFreq() const {
+            return cursor_.GetMaxTermFreq();
+        }
+
+        BlockBound GetBlockBound(DocumentIndex target) const {
+            return cursor_.GetBlockBound(target);
+        }
+
+    private:
+        CompressedPostingList::Cursor cursor_;
+        const std::vector<double>* inv_word_counts_;
     };
-    const std::set<std::string> stop_words_;
-    std::map<std::string, std::map<int, double>> word_to_document_freqs_;
-    std::map<int, DocumentData> documents_;
-    std::vector<int> document_ids_;
 
-    bool IsStopWord(const std::string& word) const {
+    template <typename Cursor>
+    Cursor MakeCursor(TermId term, size_t partition) const {
+        if constexpr (std::is_same_v<Cursor, CompressedTermCursor>) {
+            return Cursor(term_to_compressed_postings_[term].Get(partition), document_inv_word_counts_);
+        } else {
+            return Cursor(term_to_document_freqs_[term].Get(partition));
+        }
+    }
+
+    // Calls function with a cursor factory for the format of the index
+    template <typename Function>
+    auto WithCursorType(Function function) const {
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            return function([this](TermId term, size_t partition) {
+                return MakeCursor<CompressedTermCursor>(term, partition);
+            });
+        }
+        return function([this](TermId term, size_t partition) {
+            return MakeCursor<PostingList::Cursor>(term, partition);
+        });
+    }
+
+    // Term frequencies must be sorted by term. The document gets its forward entry and its
+    // table entries before any posting refers to it, and loses them all again if anything fails
+    void IndexDocument(int document_id, const std::vector<TermFreq>& term_freqs, double inv_word_count, DocumentStatus status, int rating) {
+        // Indexes only grow, so appending keeps every posting list sorted
+        const DocumentIndex document_index = static_cast<DocumentIndex>(index_to_document_id_.size());
+        if (index_format_ == IndexFormat::COMPRESSED) {
+            term_to_compressed_postings_.resize(terms_.size());
+        } else {
+            term_to_document_freqs_.resize(terms_.size());
+        }
+        idf_cache_.resize(terms_.size());
+        const size_t partition = GetStatusPartition(status);
+        try {
+            forward_index_.AddDocument();
+            for (const auto [term, term_freq] : term_freqs) {
+                forward_index_.AddTerm(term, GetTermCount(term_freq, inv_word_count));
+            }
+            AddDocumentEntry(document_id, inv_word_count, status, rating);
+            for (const auto [term, term_freq] : term_freqs) {
+                AddPosting(term, partition, document_index, term_freq, GetTermCount(term_freq, inv_word_count));
+            }
+        } catch (...) {
+            DropDocumentsFrom(document_index);
+            throw;
+        }
+        ++index_generation_;
+    }
+
+    void AddDocumentEntry(int document_id, double inv_word_count, DocumentStatus status, int rating) {
+        const DocumentIndex document_index = static_cast<DocumentIndex>(index_to_document_id_.size());
+        document_inv_word_counts_.push_back(inv_word_count);
+        index_to_document_id_.push_back(document_id);
+        document_ratings_.push_back(rating);
+        document_statuses_.push_back(status);
+        document_indexes_.emplace(document_id, document_index);
+        document_ids_.insert(document_id);
+    }
+
+    // Takes back the documents from first_index on after a failed add, whatever part of them
+    // was added. Only documents with all their table entries can have postings, and those are
+    // found through the forward index
+    void DropDocumentsFrom(DocumentIndex first_index) {
+        const size_t entry_count = std::min(document_statuses_.size(), forward_index_.GetDocumentCount());
+        for (DocumentIndex document_index = first_index; document_index < entry_count; ++document_index) {
+            const size_t partition = GetStatusPartition(document_statuses_[document_index]);
+            forward_index_.ForEach(document_index, [&](TermId term, uint32_t) {
+                RemovePosting(term, partition, document_index);
+            });
+        }
+        for (DocumentIndex document_index = first_index; document_index < index_to_document_id_.size(); ++document_index) {
+            document_indexes_.erase(index_to_document_id_[document_index]);
+            document_ids_.erase(index_to_document_id_[document_index]);
+        }
+        document_inv_word_counts_.resize(first_index);
+        index_to_document_id_.resize(first_index);
+        document_ratings_.resize(first_index);
+        document_statuses_.resize(first_index);
+        forward_index_.Truncate(first_index);
+    }
+
+    // The slot stays in the per-document tables and the forward index, but nothing refers to it anymore
+    void ReleaseDocumentIndex(std::unordered_map<int, DocumentIndex>::iterator it) {
+        document_ids_.erase(it->first);
+        document_indexes_.erase(it);
+        ++index_generation_;
+        const size_t removed_count = index_to_document_id_.size() - document_indexes_.size();
+        if (removed_count > index_to_document_id_.size() * MAX_REMOVED_DOCUMENT_SHARE) {
+            CompactDocumentIndexes();
+        }
+    }
+
+    // Renumbers the documents densely, keeping their order, and drops the slots of removed ones.
+    // Removed documents have no postings left, and the order of the rest is kept, so every
+    // posting list only needs its indexes mapped and stays sorted
+    void CompactDocumentIndexes() {
+        const size_t slot_count = index_to_document_id_.size();
+        std::vector<DocumentIndex> new_indexes(slot_count, END_OF_POSTINGS);
+        for (const auto [document_id, document_index] : document_indexes_) {
+            new_indexes[document_index] = 0;
+        }
+        DocumentIndex document_count = 0;
+        for (DocumentIndex document_index = 0; document_index < slot_count; ++document_index) {
+            if (new_indexes[document_index] == END_OF_POSTINGS) {
+                continue;
+            }
+            new_indexes[document_index] = document_count;
+            index_to_document_id_[document_count] = index_to_document_id_[document_index];
+            document_ratings_[document_count] = document_ratings_[document_index];
+            document_statuses_[document_count] = document_statuses_[document_index];
+            document_inv_word_counts_[document_count] = document_inv_word_counts_[document_index];
+            ++document_count;
+        }
+        const auto shrink = [document_count](auto& table) {
+            table.resize(document_count);
+            table.shrink_to_fit();
+        };
+        shrink(index_to_document_id_);
+        shrink(document_ratings_);
+        shrink(document_statuses_);
+        shrink(document_inv_word_counts_);
+        forward_index_.Compact(new_indexes);
+        for (auto& [document_id, document_index] : document_indexes_) {
+            document_index = new_indexes[document_index];
+        }
+        const auto renumber = [&new_indexes](auto& postings) {
+            postings.Renumber(new_indexes);
+        };
+        for (auto& term_postings : term_to_document_freqs_) {
+            term_postings.ChangeAll(renumber);
+        }
+        for (auto& term_postings : term_to_compressed_postings_) {
+            term_postings.ChangeAll(renumber);
+        }
+    }
+
+    // The term frequency is summed up one occurrence at a time, as MergeTermFreqs does, so
+    // a frequency restored from the count is exactly the one the document was indexed with
+    static double GetTermFreq(uint32_t term_count, double inv_word_count) {
+        double term_freq = inv_word_count;
+        for (uint32_t i = 1; i < term_count; ++i) {
+            term_freq += inv_word_count;
+        }
+        return term_freq;
+    }
+
+    static uint32_t GetTermCount(double term_freq, double inv_word_count) {
+        return static_cast<uint32_t>(std::lround(term_freq / inv_word_count));
+    }
+
+    // Sorts term frequencies by term and sums up repeated terms
+    static void MergeTermFreqs(std::vector<TermFreq>& term_freqs) {
+        std::sort(term_freqs.begin(), term_freqs.end(), [](const TermFreq& lhs, const TermFreq& rhs) {
+            return lhs.term < rhs.term;
+        });
+        size_t merged_count = 0;
+        for (const TermFreq& term_freq : term_freqs) {
+            if (merged_count > 0 && term_freqs[merged_count - 1].term == term_freq.term) {
+                term_freqs[merged_count - 1].term_freq += term_freq.term_freq;
+            } else {
+                term_freqs[merged_count++] = term_freq;
+            }
+        }
+        term_freqs.resize(merged_count);
+    }
+
+    bool IsStopWord(std::string_view word) const {
         return stop_words_.count(word) > 0;
     }
 
-    static bool IsValidWord(const std::string& word) {
+    static bool IsValidWord(std::string_view word) {
         // A valid word must not contain special characters
-        return none_of(word.begin(), word.end(), [](char c) {
+        return std::none_of(word.begin(), word.end(), [](char c) {
             return c >= '\0' && c < ' ';
         });
     }
 
-    std::vector<std::string> SplitIntoWordsNoStop(const std::string text) const {
-        std::vector<std::string> words;
-        for (const std::string& word : SplitIntoWords(text)) {
-            if (!IsValidWord(word)) {
-                throw std::invalid_argument("Word " + word + " is invalid");
-            }
+    static void CheckDocumentWord(std::string_view word) {
+        if (!IsValidWord(word)) {
+            throw std::invalid_argument("Word " + std::string{word} + " is invalid");
+        }
+    }
+
+    std::vector<std::string_view> SplitIntoWordsNoStop(std::string_view text) const {
+        std::vector<std::string_view> words;
+        for (const std::string_view word : SplitIntoWords(text)) {
+            CheckDocumentWord(word);
             if (!IsStopWord(word)) {
                 words.push_back(word);
             }
@@ -269,81 +1080,711 @@ private:
     }
 
     struct QueryWord {
-        std::string data;
+        std::string_view data;
         bool is_minus;
         bool is_stop;
     };
-    QueryWord ParseQueryWord(const std::string& text) const {
+    QueryWord ParseQueryWord(std::string_view text) const {
         if (text.empty()) {
             throw std::invalid_argument("Query word is empty");
         }
-        std::string word = text;
+        std::string_view word = text;
         bool is_minus = false;
         if (word[0] == '-') {
             is_minus = true;
-            word = word.substr(1);
+            word.remove_prefix(1);
         }
         if (word.empty() || word[0] == '-' || !IsValidWord(word)) {
-            throw std::invalid_argument("Query word " + text + " is invalid");
+            throw std::invalid_argument("Query word " + std::string{text} + " is invalid");
         }
 
         return {word, is_minus, IsStopWord(word)};
     }
 
+    // Words that were never indexed cannot match anything and are left out
     struct Query {
-        std::set<std::string> plus_words;
-        std::set<std::string> minus_words;
+        explicit Query(std::pmr::memory_resource* scratch)
+            : plus_terms(scratch)
+            , minus_terms(scratch) {
+        }
+
+        std::pmr::vector<TermId> plus_terms;
+        std::pmr::vector<TermId> minus_terms;
+        bool has_unindexed_plus_words = false;
     };
 
-    Query ParseQuery(const std::string& text) const {
-        Query result;
-        for (const std::string& word : SplitIntoWords(text)) {
+    Query ParseQuery(std::string_view text, std::pmr::memory_resource* scratch, bool deduplicate = true) const {
+        Query result(scratch);
+        ForEachWord(text, [this, &result](std::string_view word) {
             const auto query_word = ParseQueryWord(word);
-            if (!query_word.is_stop) {
-                if (query_word.is_minus) {
-                    result.minus_words.insert(query_word.data);
+            if (query_word.is_stop) {
+                return;
+            }
+            const TermId term = terms_.Find(query_word.data);
+            if (term == TermDictionary::NO_TERM) {
+                result.has_unindexed_plus_words |= !query_word.is_minus;
+                return;
+            }
+            if (query_word.is_minus) {
+                result.minus_terms.push_back(term);
+            } else {
+                result.plus_terms.push_back(term);
+            }
+        });
+        if (deduplicate) {
+            for (auto* terms : {&result.plus_terms, &result.minus_terms}) {
+                std::sort(terms->begin(), terms->end());
+                terms->erase(std::unique(terms->begin(), terms->end()), terms->end());
+            }
+        }
+        return result;
+    }
+
+    // Version of the counts IDF is computed from
+    uint64_t GetStatisticsGeneration() const {
+        return collection_statistics_ != nullptr ? collection_statistics_->GetGeneration() : index_generation_;
+    }
+
+    // Postings required
+    double ComputeWordInverseDocumentFreq(TermId term) const {
+        CachedIdf& cached = idf_cache_[term];
+        const uint64_t generation = GetStatisticsGeneration();
+        if (cached.generation.load(std::memory_order_acquire) == generation) {
+            return cached.value.load(std::memory_order_relaxed);
+        }
+        double inverse_document_freq;
+        if (collection_statistics_ != nullptr) {
+            // The collection may no longer count the documents of this server that are about to be removed
+            inverse_document_freq = log(std::max<size_t>(collection_statistics_->GetDocumentCount(), 1) * 1.0
+                                        / std::max<size_t>(collection_statistics_->GetDocumentFreq(terms_.GetTerm(term)), 1));
+        } else {
+            inverse_document_freq = log(GetDocumentCount() * 1.0 / GetDocumentFreq(term));
+        }
+        cached.value.store(inverse_document_freq, std::memory_order_relaxed);
+        cached.generation.store(generation, std::memory_order_release);
+        return inverse_document_freq;
+    }
+
+    DocumentIndexSet ResolveDocumentIds(const DocumentIdIn& document_predicate, std::pmr::memory_resource* scratch) const {
+        DocumentIndexSet result{std::pmr::vector<DocumentIndex>(scratch)};
+        for (const int document_id : document_predicate.document_ids) {
+            const auto it = document_indexes_.find(document_id);
+            if (it != document_indexes_.end()) {
+                result.indexes.push_back(it->second);
+            }
+        }
+        std::sort(result.indexes.begin(), result.indexes.end());
+        result.indexes.erase(std::unique(result.indexes.begin(), result.indexes.end()), result.indexes.end());
+        return result;
+    }
+
+    // Status partitions that may hold documents accepted by the predicate
+    template <typename DocumentPredicate>
+    static StatusSet GetScannedStatuses(const DocumentPredicate& document_predicate) {
+        if constexpr (std::is_same_v<DocumentPredicate, StatusEquals>) {
+            return StatusSet{}.set(GetStatusPartition(document_predicate.status));
+        } else {
+            return ALL_STATUSES;
+        }
+    }
+
+    template <typename DocumentPredicate>
+    bool MatchesPredicate(const DocumentPredicate& document_predicate, DocumentIndex document_index) const {
+        if constexpr (std::is_same_v<DocumentPredicate, StatusEquals>) {
+            // Only the matching partition is scanned
+            return true;
+        } else if constexpr (std::is_same_v<DocumentPredicate, RatingBetween>) {
+            const int rating = document_ratings_[document_index];
+            return document_predicate.min_rating <= rating && rating <= document_predicate.max_rating;
+        } else if constexpr (std::is_same_v<DocumentPredicate, DocumentIndexSet>) {
+            return std::binary_search(document_predicate.indexes.begin(), document_predicate.indexes.end(), document_index);
+        } else {
+            return document_predicate(index_to_document_id_[document_index], document_statuses_[document_index], document_ratings_[document_index]);
+        }
+    }
+
+    // Visits the postings of the term that belong to the given status partitions
+    template <typename Action>
+    void ForEachPosting(TermId term, StatusSet statuses, Action action) const {
+        for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+            if (!statuses.test(partition)) {
+                continue;
+            }
+            if (index_format_ == IndexFormat::COMPRESSED) {
+                term_to_compressed_postings_[term].Get(partition).ForEach([&](DocumentIndex document_index, uint32_t term_count) {
+                    action(document_index, term_count * document_inv_word_counts_[document_index]);
+                });
+            } else {
+                term_to_document_freqs_[term].Get(partition).ForEach(action);
+            }
+        }
+    }
+
+    // Sorted indexes of the documents that contain any of the terms, over the given status partitions
+    template <typename TermIterator>
+    std::pmr::vector<DocumentIndex> CollectDocuments(TermIterator first_term, TermIterator last_term, StatusSet statuses,
+                                                     std::pmr::memory_resource* scratch) const {
+        std::pmr::vector<DocumentIndex> documents(scratch);
+        std::pmr::vector<DocumentIndex> merged(scratch);
+        std::pmr::vector<DocumentIndex> decoded(scratch);
+        const auto merge_in = [&](const auto& postings) {
+            merged.resize(documents.size() + postings.size());
+            std::merge(documents.begin(), documents.end(), postings.begin(), postings.end(), merged.begin());
+            std::swap(documents, merged);
+        };
+        for (auto term = first_term; term != last_term; ++term) {
+            for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+                if (!statuses.test(partition)) {
+                    continue;
+                }
+                if (index_format_ == IndexFormat::COMPRESSED) {
+                    decoded.clear();
+                    term_to_compressed_postings_[*term].Get(partition).ForEach([&decoded](DocumentIndex document_index, uint32_t) {
+                        decoded.push_back(document_index);
+                    });
+                    merge_in(decoded);
                 } else {
-                    result.plus_words.insert(query_word.data);
+                    merge_in(term_to_document_freqs_[*term].Get(partition).GetDocuments());
                 }
             }
         }
-        return result;
+        if (last_term - first_term > 1) {
+            documents.erase(std::unique(documents.begin(), documents.end()), documents.end());
+        }
+        return documents;
+    }
+
+    // Calls action(term, first_use, last_use) for every run of (term, query) pairs with the same term
+    template <typename TermUses, typename Action>
+    static void ForEachTermGroup(const TermUses& uses, Action action) {
+        for (auto first_use = uses.begin(); first_use != uses.end();) {
+            const auto last_use = std::find_if(first_use, uses.end(), [first_use](const auto& use) {
+                return use.first != first_use->first;
+            });
+            action(first_use->first, first_use, last_use);
+            first_use = last_use;
+        }
+    }
+
+    // Visits the postings of the term whose documents satisfy the predicate, checking the limits
+    // every LIMIT_CHECK_INTERVAL postings or wanted documents
+    template <typename DocumentPredicate, typename Action>
+    void ForEachMatchingPosting(TermId term, const DocumentPredicate& document_predicate, const QueryLimits* limits, Action action) const {
+        size_t step = 0;
+        if constexpr (std::is_same_v<DocumentPredicate, DocumentIndexSet>) {
+            // Both sides are sorted, so look up each wanted document after the previous one
+            WithCursorType([&](auto make_cursor) {
+                for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+                    auto cursor = make_cursor(term, partition);
+                    for (const DocumentIndex document_index : document_predicate.indexes) {
+                        if (++step % LIMIT_CHECK_INTERVAL == 0) {
+                            CheckQueryLimits(limits);
+                        }
+                        cursor.Seek(document_index);
+                        if (cursor.Document() == END_OF_POSTINGS) {
+                            break;
+                        }
+                        if (cursor.Document() == document_index) {
+                            action(document_index, cursor.TermFreq());
+                        }
+                    }
+                }
+            });
+        } else {
+            ForEachPosting(term, GetScannedStatuses(document_predicate), [&](DocumentIndex document_index, double term_freq) {
+                if (++step % LIMIT_CHECK_INTERVAL == 0) {
+                    CheckQueryLimits(limits);
+                }
+                if (MatchesPredicate(document_predicate, document_index)) {
+                    action(document_index, term_freq);
+                }
+            });
+        }
+    }
+
+    // Limits are only given by asynchronous queries. Every way of evaluating a query checks
+    // them at least once per term, and scans of postings every LIMIT_CHECK_INTERVAL steps
+    static void CheckQueryLimits(const QueryLimits* limits) {
+        if (limits == nullptr) {
+            return;
+        }
+        if (limits->cancellation.IsCancelled()) {
+            throw QueryAbandoned("Query was cancelled");
+        }
+        if (std::chrono::steady_clock::now() >= limits->deadline) {
+            throw QueryAbandoned("Query missed its deadline");
+        }
     }
 
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const std::string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+    // Only the predicate tags with a few arguments are cached
+    static std::optional<std::array<int64_t, 3>> GetPredicateCacheTag(const StatusEquals& document_predicate) {
+        return std::array<int64_t, 3>{0, static_cast<int64_t>(document_predicate.status), 0};
+    }
+
+    static std::optional<std::array<int64_t, 3>> GetPredicateCacheTag(const RatingBetween& document_predicate) {
+        return std::array<int64_t, 3>{1, document_predicate.min_rating, document_predicate.max_rating};
     }
 
     template <typename DocumentPredicate>
-    std::vector<Document> FindAllDocuments(const Query& query, DocumentPredicate document_predicate) const {
-        std::map<int, double> document_to_relevance;
-        for (const std::string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+    static std::optional<std::array<int64_t, 3>> GetPredicateCacheTag(const DocumentPredicate&) {
+        return std::nullopt;
+    }
+
+    template <typename DocumentPredicate>
+    std::optional<QueryCacheLookup> MakeQueryCacheLookup(const Query& query, const DocumentPredicate& document_predicate, size_t max_document_count,
+                                                         QueryMode query_mode) const {
+        const auto tag = GetPredicateCacheTag(document_predicate);
+        if (!tag || query_cache_.GetCapacity() == 0) {
+            return std::nullopt;
+        }
+        return QueryCacheLookup{query.plus_terms.data(), query.plus_terms.size(), query.minus_terms.data(), query.minus_terms.size(),
+                                {(*tag)[0], (*tag)[1], (*tag)[2], static_cast<int64_t>(query_mode), query.has_unindexed_plus_words,
+                                 static_cast<int64_t>(max_document_count)}};
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    std::vector<Document> FindTopDocumentsWithin(ExecutionPolicy&& policy, std::string_view raw_query, const DocumentPredicate& document_predicate,
+                                                 size_t max_document_count, QueryMode query_mode, const QueryLimits* limits) const {
+        // Temporaries of the query live in the scratch arena of this thread
+        const QueryArena::Scope scratch;
+        const auto query = ParseQuery(raw_query, scratch.GetResource());
+        if constexpr (std::is_same_v<DocumentPredicate, DocumentIdIn>) {
+            return SelectTopDocuments(policy, query, ResolveDocumentIds(document_predicate, scratch.GetResource()), max_document_count, query_mode,
+                                      scratch.GetResource(), limits);
+        } else {
+            const auto cache_lookup = MakeQueryCacheLookup(query, document_predicate, max_document_count, query_mode);
+            if (cache_lookup) {
+                if (auto cached = query_cache_.Find(*cache_lookup, GetStatisticsGeneration())) {
+                    return std::move(*cached);
+                }
+            }
+            auto result = SelectTopDocuments(policy, query, document_predicate, max_document_count, query_mode, scratch.GetResource(), limits);
+            if (cache_lookup) {
+                query_cache_.Insert(*cache_lookup, GetStatisticsGeneration(), result);
+            }
+            return result;
+        }
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    std::vector<Document> SelectTopDocuments(ExecutionPolicy&& policy, const Query& query, const DocumentPredicate& document_predicate,
+                                             size_t max_document_count, QueryMode query_mode, std::pmr::memory_resource* scratch,
+                                             const QueryLimits* limits) const {
+        // A small id set is cheaper to look up directly than to prune
+        if constexpr (std::is_same_v<std::decay_t<ExecutionPolicy>, std::execution::sequenced_policy>
+                      && !std::is_same_v<DocumentPredicate, DocumentIndexSet>) {
+            if (query_mode == QueryMode::ANY_WORD) {
+                return WithCursorType([&](auto make_cursor) {
+                    return FindTopDocumentsPruned(query, document_predicate, max_document_count, make_cursor, scratch, limits);
+                });
+            }
+        }
+
+        auto matched_documents = query_mode == QueryMode::ALL_WORDS ? FindDocumentsWithAllWords(query, document_predicate, scratch, limits)
+                                                                    : FindAllDocuments(policy, query, document_predicate, scratch, limits);
+
+        // Only the first max_document_count positions need to be ordered
+        const auto top_end = matched_documents.begin() + std::min(matched_documents.size(), max_document_count);
+        std::partial_sort(policy, matched_documents.begin(), top_end, matched_documents.end(), IsMoreRelevant);
+
+        return std::vector<Document>(matched_documents.begin(), top_end);
+    }
+
+    static bool IsMoreRelevant(const Document& lhs, const Document& rhs) {
+        if (abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON) {
+            return lhs.rating > rhs.rating;
+        } else {
+            return lhs.relevance > rhs.relevance;
+        }
+    }
+
+    // Document-at-a-time evaluation with block-max WAND pruning. Every term cursor knows an
+    // upper bound of its scores, for the whole list and for each block of postings. Documents
+    // whose bound cannot beat the current top are skipped unscored, which gives the same
+    // result as scoring every document
+    template <typename DocumentPredicate, typename MakeCursor>
+    std::vector<Document> FindTopDocumentsPruned(const Query& query, const DocumentPredicate& document_predicate,
+                                                 size_t max_document_count, MakeCursor make_cursor, std::pmr::memory_resource* scratch,
+                                                 const QueryLimits* limits) const {
+        using Cursor = decltype(make_cursor(TermId{}, size_t{}));
+        struct TermCursor {
+            Cursor cursor;
+            double inverse_document_freq;
+            double max_relevance;
+        };
+        if (max_document_count == 0) {
+            return {};
+        }
+
+        const StatusSet statuses = GetScannedStatuses(document_predicate);
+        // Kept in query order, so relevance is summed up in the same order as in FindAllDocuments
+        std::pmr::vector<TermCursor> plus_cursors(scratch);
+        std::pmr::vector<Cursor> minus_cursors(scratch);
+        for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+            if (!statuses.test(partition)) {
+                continue;
+            }
+            for (const TermId term : query.minus_terms) {
+                if (GetPostingCount(term, partition) > 0) {
+                    minus_cursors.push_back(make_cursor(term, partition));
+                }
+            }
+        }
+        for (const TermId term : query.plus_terms) {
+            for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+                if (statuses.test(partition) && GetPostingCount(term, partition) > 0) {
+                    const double inverse_document_freq = ComputeWordInverseDocumentFreq(term);
+                    Cursor cursor = make_cursor(term, partition);
+                    const double max_relevance = cursor.GetMaxTermFreq() * inverse_document_freq;
+                    plus_cursors.push_back({std::move(cursor), inverse_document_freq, max_relevance});
+                }
+            }
+        }
+
+        std::pmr::vector<TermCursor*> by_document(scratch);
+        for (TermCursor& term_cursor : plus_cursors) {
+            by_document.push_back(&term_cursor);
+        }
+        std::pmr::vector<Document> top(scratch);
+
+        for (size_t step = 1;; ++step) {
+            if (step % LIMIT_CHECK_INTERVAL == 0) {
+                CheckQueryLimits(limits);
+            }
+            std::sort(by_document.begin(), by_document.end(), [](const TermCursor* lhs, const TermCursor* rhs) {
+                return lhs->cursor.Document() < rhs->cursor.Document();
+            });
+            // A document has to score above this to enter the top. The margin covers the
+            // tie-break by rating and rounding in the sums of bounds
+            const double threshold = top.size() < max_document_count ? std::numeric_limits<double>::lowest()
+                                                                     : top.front().relevance - 2 * RELEVANCE_EPSILON;
+
+            // The pivot is the first document that the cursors up to it could lift above the threshold
+            double bound = 0.0;
+            size_t pivot = by_document.size();
+            for (size_t i = 0; i < by_document.size() && by_document[i]->cursor.Document() != END_OF_POSTINGS; ++i) {
+                bound += by_document[i]->max_relevance;
+                if (bound > threshold) {
+                    pivot = i;
+                    break;
+                }
+            }
+            if (pivot == by_document.size()) {
+                break;
+            }
+            const DocumentIndex pivot_document = by_document[pivot]->cursor.Document();
+            while (pivot + 1 < by_document.size() && by_document[pivot + 1]->cursor.Document() == pivot_document) {
+                ++pivot;
+            }
+
+            // Refine the bound with the blocks around the pivot document
+            double block_bound = 0.0;
+            DocumentIndex next_document = pivot + 1 < by_document.size() ? by_document[pivot + 1]->cursor.Document() : END_OF_POSTINGS;
+            for (size_t i = 0; i <= pivot; ++i) {
+                const BlockBound block = by_document[i]->cursor.GetBlockBound(pivot_document);
+                if (block.last_document != END_OF_POSTINGS) {
+                    block_bound += block.max_term_freq * by_document[i]->inverse_document_freq;
+                    next_document = std::min(next_document, block.last_document + 1);
+                }
+            }
+            if (block_bound <= threshold) {
+                for (size_t i = 0; i <= pivot; ++i) {
+                    by_document[i]->cursor.Seek(next_document);
+                }
                 continue;
             }
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                const auto& document_data = documents_.at(document_id);
-                if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
+
+            if (by_document[0]->cursor.Document() != pivot_document) {
+                for (size_t i = 0; i < pivot; ++i) {
+                    by_document[i]->cursor.Seek(pivot_document);
+                }
+                continue;
+            }
+
+            const bool excluded = std::any_of(minus_cursors.begin(), minus_cursors.end(), [pivot_document](Cursor& cursor) {
+                cursor.Seek(pivot_document);
+                return cursor.Document() == pivot_document;
+            });
+            if (!excluded && MatchesPredicate(document_predicate, pivot_document)) {
+                double relevance = 0.0;
+                for (const TermCursor& term_cursor : plus_cursors) {
+                    if (term_cursor.cursor.Document() == pivot_document) {
+                        relevance += term_cursor.cursor.TermFreq() * term_cursor.inverse_document_freq;
+                    }
+                }
+                OfferTopDocument(top, {index_to_document_id_[pivot_document], relevance, document_ratings_[pivot_document]}, max_document_count);
+            }
+            for (size_t i = 0; i <= pivot; ++i) {
+                by_document[i]->cursor.Seek(pivot_document + 1);
+            }
+        }
+
+        std::sort_heap(top.begin(), top.end(), IsMoreRelevant);
+        return std::vector<Document>(top.begin(), top.end());
+    }
+
+    // Keeps the max_document_count most relevant documents offered in a heap, the least relevant on top
+    static void OfferTopDocument(std::pmr::vector<Document>& top, const Document& document, size_t max_document_count) {
+        if (top.size() < max_document_count) {
+            top.push_back(document);
+            std::push_heap(top.begin(), top.end(), IsMoreRelevant);
+        } else if (max_document_count > 0 && IsMoreRelevant(document, top.front())) {
+            std::pop_heap(top.begin(), top.end(), IsMoreRelevant);
+            top.back() = document;
+            std::push_heap(top.begin(), top.end(), IsMoreRelevant);
+        }
+    }
+
+    // Term cursors of a batch, with the queries that use the term. Plus words come first, in
+    // increasing term order, so every document adds up its words as in FindAllDocuments
+    template <typename MakeCursor>
+    std::pmr::vector<std::vector<Document>> EvaluateBatch(const std::pmr::vector<Query>& queries, StatusSet statuses, size_t max_document_count,
+                                                          MakeCursor make_cursor, std::pmr::memory_resource* memory) const {
+        using Cursor = decltype(make_cursor(TermId{}, size_t{}));
+        struct TermScan {
+            size_t first_cursor;
+            size_t last_cursor;
+            size_t first_use;
+            size_t last_use;
+            bool is_minus;
+            double inverse_document_freq;
+        };
+        enum : uint8_t { FOUND = 1, EXCLUDED = 2 };
+
+        std::pmr::vector<std::pair<TermId, size_t>> plus_uses(memory);
+        std::pmr::vector<std::pair<TermId, size_t>> minus_uses(memory);
+        for (size_t query = 0; query < queries.size(); ++query) {
+            for (const TermId term : queries[query].plus_terms) {
+                plus_uses.push_back({term, query});
+            }
+            for (const TermId term : queries[query].minus_terms) {
+                minus_uses.push_back({term, query});
+            }
+        }
+        std::sort(plus_uses.begin(), plus_uses.end());
+        std::sort(minus_uses.begin(), minus_uses.end());
+
+        std::pmr::vector<Cursor> cursors(memory);
+        std::pmr::vector<TermScan> scans(memory);
+        std::pmr::vector<size_t> use_queries(memory);
+        for (const auto* uses : {&plus_uses, &minus_uses}) {
+            ForEachTermGroup(*uses, [&](TermId term, auto first_use, auto last_use) {
+                const bool is_minus = uses == &minus_uses;
+                if (GetDocumentFreq(term) == 0) {
+                    return;
+                }
+                TermScan scan{cursors.size(), cursors.size(), use_queries.size(), use_queries.size(), is_minus,
+                              is_minus ? 0.0 : ComputeWordInverseDocumentFreq(term)};
+                for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+                    if (statuses.test(partition) && GetPostingCount(term, partition) > 0) {
+                        cursors.push_back(make_cursor(term, partition));
+                    }
+                }
+                for (auto use = first_use; use != last_use; ++use) {
+                    use_queries.push_back(use->second);
+                }
+                scan.last_cursor = cursors.size();
+                scan.last_use = use_queries.size();
+                scans.push_back(scan);
+            });
+        }
+
+        // Accumulators of every query for a range of documents, sized to stay in cache
+        const size_t range_size = std::max(BATCH_MIN_RANGE_SIZE, BATCH_ACCUMULATOR_COUNT / std::max<size_t>(queries.size(), 1));
+        std::pmr::vector<double> relevances(queries.size() * range_size, 0.0, memory);
+        std::pmr::vector<uint8_t> states(queries.size() * range_size, 0, memory);
+        std::pmr::vector<uint8_t> query_touched(queries.size(), 0, memory);
+        std::pmr::vector<std::pmr::vector<Document>> tops(queries.size(), memory);
+
+        const size_t document_count = index_to_document_id_.size();
+        for (size_t range_begin = 0; range_begin < document_count; range_begin += range_size) {
+            const DocumentIndex range_end = static_cast<DocumentIndex>(std::min(document_count, range_begin + range_size));
+            for (const TermScan& scan : scans) {
+                for (size_t c = scan.first_cursor; c < scan.last_cursor; ++c) {
+                    Cursor& cursor = cursors[c];
+                    for (; cursor.Document() < range_end; cursor.Next()) {
+                        const size_t offset = cursor.Document() - range_begin;
+                        const double relevance = scan.is_minus ? 0.0 : cursor.TermFreq() * scan.inverse_document_freq;
+                        for (size_t use = scan.first_use; use < scan.last_use; ++use) {
+                            const size_t query = use_queries[use];
+                            const size_t slot = query * range_size + offset;
+                            relevances[slot] += relevance;
+                            states[slot] |= scan.is_minus ? EXCLUDED : FOUND;
+                            query_touched[query] = 1;
+                        }
+                    }
                 }
             }
+
+            for (size_t query = 0; query < queries.size(); ++query) {
+                if (!query_touched[query]) {
+                    continue;
+                }
+                for (size_t offset = 0; offset < range_end - range_begin; ++offset) {
+                    const size_t slot = query * range_size + offset;
+                    if (states[slot] == FOUND) {
+                        const DocumentIndex document_index = static_cast<DocumentIndex>(range_begin + offset);
+                        OfferTopDocument(tops[query], {index_to_document_id_[document_index], relevances[slot], document_ratings_[document_index]},
+                                         max_document_count);
+                    }
+                }
+                std::fill_n(relevances.begin() + query * range_size, range_size, 0.0);
+                std::fill_n(states.begin() + query * range_size, range_size, 0);
+                query_touched[query] = 0;
+            }
+        }
+
+        std::pmr::vector<std::vector<Document>> top_documents(memory);
+        top_documents.reserve(queries.size());
+        for (auto& top : tops) {
+            std::sort_heap(top.begin(), top.end(), IsMoreRelevant);
+            top_documents.emplace_back(top.begin(), top.end());
+        }
+        return top_documents;
+    }
+
+    template <typename DocumentPredicate>
+    std::pmr::vector<Document> FindAllDocuments(const std::execution::sequenced_policy&, const Query& query, const DocumentPredicate& document_predicate,
+                                                std::pmr::memory_resource* scratch, const QueryLimits* limits) const {
+        return FindAllDocuments(query, document_predicate, scratch, limits);
+    }
+
+    // The scratch arena belongs to the calling thread, so the parallel part allocates from the heap
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    std::pmr::vector<Document> FindAllDocuments(ExecutionPolicy&& policy, const Query& query, const DocumentPredicate& document_predicate,
+                                                std::pmr::memory_resource* scratch, const QueryLimits* limits) const {
+        const StatusSet statuses = GetScannedStatuses(document_predicate);
+        ConcurrentMap<DocumentIndex, double> document_to_relevance(RELEVANCE_BUCKET_COUNT);
+        // Parallel algorithms terminate on exceptions, so an abandoned term passes its exception on by hand
+        std::vector<std::exception_ptr> term_errors(query.plus_terms.size());
+        std::vector<size_t> term_indexes(query.plus_terms.size());
+        std::iota(term_indexes.begin(), term_indexes.end(), 0);
+        std::for_each(policy, term_indexes.begin(), term_indexes.end(), [&](size_t term_index) {
+            const TermId term = query.plus_terms[term_index];
+            if (GetDocumentFreq(term) == 0) {
+                return;
+            }
+            try {
+                CheckQueryLimits(limits);
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(term);
+                ForEachMatchingPosting(term, document_predicate, limits, [&](DocumentIndex document_index, double term_freq) {
+                    document_to_relevance[document_index].ref_to_value += term_freq * inverse_document_freq;
+                });
+            } catch (...) {
+                term_errors[term_index] = std::current_exception();
+            }
+        });
+        for (const std::exception_ptr& error : term_errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
         }
 
-        for (const std::string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+        return ExcludeMinusWords(document_to_relevance.BuildOrdinaryMap(), query, statuses, scratch);
+    }
+
+    template <typename DocumentPredicate>
+    std::pmr::vector<Document> FindAllDocuments(const Query& query, const DocumentPredicate& document_predicate, std::pmr::memory_resource* scratch,
+                                                const QueryLimits* limits) const {
+        const StatusSet statuses = GetScannedStatuses(document_predicate);
+        std::pmr::map<DocumentIndex, double> document_to_relevance(scratch);
+        for (const TermId term : query.plus_terms) {
+            if (GetDocumentFreq(term) == 0) {
                 continue;
             }
-            for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
+            CheckQueryLimits(limits);
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(term);
+            ForEachMatchingPosting(term, document_predicate, limits, [&](DocumentIndex document_index, double term_freq) {
+                document_to_relevance[document_index] += term_freq * inverse_document_freq;
+            });
+        }
+
+        return ExcludeMinusWords(document_to_relevance, query, statuses, scratch);
+    }
+
+    // Subtracts the documents with minus words from the found ones as sorted sets
+    template <typename DocumentToRelevance>
+    std::pmr::vector<Document> ExcludeMinusWords(const DocumentToRelevance& document_to_relevance, const Query& query, StatusSet statuses,
+                                                 std::pmr::memory_resource* scratch) const {
+        std::pmr::vector<DocumentIndex> document_indexes(scratch);
+        document_indexes.reserve(document_to_relevance.size());
+        for (const auto [document_index, _] : document_to_relevance) {
+            document_indexes.push_back(document_index);
+        }
+        SubtractSorted(document_indexes, CollectDocuments(query.minus_terms.begin(), query.minus_terms.end(), statuses, scratch));
+
+        std::pmr::vector<Document> matched_documents(scratch);
+        matched_documents.reserve(document_indexes.size());
+        auto it = document_to_relevance.begin();
+        for (const DocumentIndex document_index : document_indexes) {
+            while (it->first < document_index) {
+                ++it;
             }
+            matched_documents.push_back({index_to_document_id_[document_index], it->second, document_ratings_[document_index]});
         }
+        return matched_documents;
+    }
 
-        std::vector<Document> matched_documents;
-        for (const auto [document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back({document_id, relevance, documents_.at(document_id).rating});
+    // Candidates are the intersection of the documents of every plus word, rarest word first,
+    // so the set shrinks as early as possible. Only they are scored
+    template <typename DocumentPredicate>
+    std::pmr::vector<Document> FindDocumentsWithAllWords(const Query& query, const DocumentPredicate& document_predicate,
+                                                         std::pmr::memory_resource* scratch, const QueryLimits* limits) const {
+        if (query.plus_terms.empty() || query.has_unindexed_plus_words) {
+            return {};
+        }
+        const StatusSet statuses = GetScannedStatuses(document_predicate);
+        std::pmr::vector<TermId> terms_by_freq(query.plus_terms, scratch);
+        std::sort(terms_by_freq.begin(), terms_by_freq.end(), [this](TermId lhs, TermId rhs) {
+            return GetDocumentFreq(lhs) < GetDocumentFreq(rhs);
+        });
+
+        std::pmr::vector<DocumentIndex> candidates = CollectDocuments(terms_by_freq.begin(), terms_by_freq.begin() + 1, statuses, scratch);
+        if constexpr (std::is_same_v<DocumentPredicate, DocumentIndexSet>) {
+            IntersectSorted(candidates, document_predicate.indexes);
+        }
+        for (size_t i = 1; i < terms_by_freq.size() && !candidates.empty(); ++i) {
+            CheckQueryLimits(limits);
+            IntersectSorted(candidates, CollectDocuments(terms_by_freq.begin() + i, terms_by_freq.begin() + i + 1, statuses, scratch));
+        }
+        CheckQueryLimits(limits);
+        SubtractSorted(candidates, CollectDocuments(query.minus_terms.begin(), query.minus_terms.end(), statuses, scratch));
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [this, &document_predicate](DocumentIndex document_index) {
+            return !MatchesPredicate(document_predicate, document_index);
+        }), candidates.end());
+        if (candidates.empty()) {
+            return {};
+        }
+
+        // Relevance is summed up in query order, as in FindAllDocuments
+        std::pmr::vector<double> relevances(candidates.size(), 0.0, scratch);
+        for (const TermId term : query.plus_terms) {
+            CheckQueryLimits(limits);
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(term);
+            WithCursorType([&](auto make_cursor) {
+                for (size_t partition = 0; partition < STATUS_COUNT; ++partition) {
+                    if (!statuses.test(partition)) {
+                        continue;
+                    }
+                    auto cursor = make_cursor(term, partition);
+                    for (size_t i = 0; i < candidates.size(); ++i) {
+                        cursor.Seek(candidates[i]);
+                        if (cursor.Document() == candidates[i]) {
+                            relevances[i] += cursor.TermFreq() * inverse_document_freq;
+                        }
+                    }
+                }
+            });
+        }
+
+        std::pmr::vector<Document> matched_documents(scratch);
+        matched_documents.reserve(candidates.size());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            matched_documents.push_back({index_to_document_id_[candidates[i]], relevances[i], document_ratings_[candidates[i]]});
         }
         return matched_documents;
     }
+
+    // Declared last, so it is destroyed first: queued queries finish while the index is still there
+    mutable AsyncExecutor async_executor_;
 };
@@ -0,0 +1,852 @@
+// Differential tests of SearchServer. A model that answers every query by scanning all documents
+// checks the index through random adds and removals, and every other way of running a query is
+// checked against the plain FindTopDocuments.
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined search_server_test.cpp -o search_server_test -ltbb -lpthread
+#include "process_queries.h"
+#include "search_server.h"
+#include "test_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <execution>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <new>
+#include <optional>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std::string_literals;
+
+const std::set<std::string> STOP_WORDS = {"and", "in"};
+const int VOCABULARY_SIZE = 80;
+const int ALL_DOCUMENTS = std::numeric_limits<int>::max();
+const DocumentStatus DOCUMENT_STATUSES[] = {DocumentStatus::ACTUAL, DocumentStatus::IRRELEVANT, DocumentStatus::BANNED, DocumentStatus::REMOVED};
+
+// Once armed with a count, that many more allocations succeed and the next one throws
+std::atomic<long> allocations_until_failure{-1};
+
+void* operator new(std::size_t size) {
+    if (allocations_until_failure.load(std::memory_order_relaxed) >= 0 && allocations_until_failure.fetch_sub(1) == 0) {
+        throw std::bad_alloc();
+    }
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+// Out of line, so the compiler does not take free for a mismatch with new
+[[gnu::noinline]] void FreeAllocation(void* pointer) {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer) noexcept {
+    FreeAllocation(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    FreeAllocation(pointer);
+}
+
+// Straightforward model of the index: no postings, just the words of every document
+class ReferenceIndex {
+public:
+    void Add(int document_id, std::string_view text, DocumentStatus status, const std::vector<int>& ratings) {
+        Entry& entry = documents_[document_id];
+        for (const std::string_view word : SplitIntoWords(text)) {
+            if (STOP_WORDS.count(std::string(word)) == 0) {
+                ++entry.word_counts[std::string(word)];
+                ++entry.word_count;
+            }
+        }
+        entry.status = status;
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+        entry.rating = ratings.empty() ? 0 : rating_sum / static_cast<int>(ratings.size());
+    }
+
+    void Remove(int document_id) {
+        documents_.erase(document_id);
+    }
+
+    int GetDocumentCount() const {
+        return static_cast<int>(documents_.size());
+    }
+
+    // Above every id in the index
+    int GetNextId() const {
+        return documents_.empty() ? 0 : documents_.rbegin()->first + 1;
+    }
+
+    const std::map<int, DocumentStatus> GetStatuses() const {
+        std::map<int, DocumentStatus> statuses;
+        for (const auto& [document_id, entry] : documents_) {
+            statuses.emplace(document_id, entry.status);
+        }
+        return statuses;
+    }
+
+    // Every matching document the predicate accepts, in no particular order
+    template <typename DocumentPredicate>
+    std::vector<Document> FindAll(std::string_view raw_query, DocumentPredicate document_predicate, QueryMode mode = QueryMode::ANY_WORD) const {
+        const auto [plus_words, minus_words] = ParseQuery(raw_query);
+        std::map<std::string, double> inverse_document_freqs;
+        for (const std::string& word : plus_words) {
+            inverse_document_freqs[word] = std::log(GetDocumentCount() * 1.0 / GetDocumentFreq(word));
+        }
+        std::vector<Document> result;
+        for (const auto& [document_id, entry] : documents_) {
+            if (!document_predicate(document_id, entry.status, entry.rating) || ContainsAny(entry, minus_words)) {
+                continue;
+            }
+            double relevance = 0.0;
+            size_t matched_count = 0;
+            for (const std::string& word : plus_words) {
+                const auto it = entry.word_counts.find(word);
+                if (it != entry.word_counts.end()) {
+                    relevance += it->second * 1.0 / entry.word_count * inverse_document_freqs.at(word);
+                    ++matched_count;
+                }
+            }
+            if (mode == QueryMode::ALL_WORDS ? matched_count == plus_words.size() && !plus_words.empty() : matched_count > 0) {
+                result.emplace_back(document_id, relevance, entry.rating);
+            }
+        }
+        return result;
+    }
+
+    std::vector<Document> FindAll(std::string_view raw_query, DocumentStatus status, QueryMode mode = QueryMode::ANY_WORD) const {
+        return FindAll(raw_query, [status](int, DocumentStatus document_status, int) {
+            return document_status == status;
+        }, mode);
+    }
+
+    std::map<std::string, double> GetWordFrequencies(int document_id) const {
+        std::map<std::string, double> word_freqs;
+        const Entry& entry = documents_.at(document_id);
+        for (const auto& [word, count] : entry.word_counts) {
+            word_freqs.emplace(word, count * 1.0 / entry.word_count);
+        }
+        return word_freqs;
+    }
+
+    std::vector<std::string> Match(std::string_view raw_query, int document_id) const {
+        const auto [plus_words, minus_words] = ParseQuery(raw_query);
+        const Entry& entry = documents_.at(document_id);
+        std::vector<std::string> matched_words;
+        if (ContainsAny(entry, minus_words)) {
+            return matched_words;
+        }
+        for (const std::string& word : plus_words) {
+            if (entry.word_counts.count(word) > 0) {
+                matched_words.push_back(word);
+            }
+        }
+        return matched_words;
+    }
+
+private:
+    struct Entry {
+        std::map<std::string, int> word_counts;
+        int word_count = 0;
+        DocumentStatus status = DocumentStatus::ACTUAL;
+        int rating = 0;
+    };
+
+    static std::pair<std::set<std::string>, std::set<std::string>> ParseQuery(std::string_view raw_query) {
+        std::set<std::string> plus_words;
+        std::set<std::string> minus_words;
+        for (std::string_view word : SplitIntoWords(raw_query)) {
+            const bool is_minus = word[0] == '-';
+            if (is_minus) {
+                word.remove_prefix(1);
+            }
+            if (STOP_WORDS.count(std::string(word)) == 0) {
+                (is_minus ? minus_words : plus_words).emplace(word);
+            }
+        }
+        return {plus_words, minus_words};
+    }
+
+    static bool ContainsAny(const Entry& entry, const std::set<std::string>& words) {
+        for (const std::string& word : words) {
+            if (entry.word_counts.count(word) > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int GetDocumentFreq(const std::string& word) const {
+        int document_freq = 0;
+        for (const auto& [document_id, entry] : documents_) {
+            document_freq += entry.word_counts.count(word);
+        }
+        return document_freq;
+    }
+
+    std::map<int, Entry> documents_;
+};
+
+std::string MakeWord(std::mt19937& generator) {
+    // Low numbers are more frequent, so the posting lists differ in length
+    return "w"s + std::to_string(std::min(generator() % VOCABULARY_SIZE, generator() % VOCABULARY_SIZE));
+}
+
+// Always holds at least one word that is not a stop word
+std::string MakeText(std::mt19937& generator) {
+    std::string text = MakeWord(generator);
+    const int word_count = static_cast<int>(generator() % 12);
+    for (int i = 0; i < word_count; ++i) {
+        text += ' ';
+        text += generator() % 8 == 0 ? *std::next(STOP_WORDS.begin(), generator() % STOP_WORDS.size()) : MakeWord(generator);
+    }
+    return text;
+}
+
+std::string MakeQuery(std::mt19937& generator) {
+    std::string query;
+    const int word_count = 1 + static_cast<int>(generator() % 4);
+    for (int i = 0; i < word_count; ++i) {
+        const unsigned kind = generator() % 10;
+        if (kind == 0) {
+            query += "-";
+        }
+        query += kind == 1 ? "unknown"s : kind == 2 ? "and"s : MakeWord(generator);
+        query += ' ';
+    }
+    return query;
+}
+
+std::vector<std::string> MakeQueries(std::mt19937& generator, int query_count) {
+    std::vector<std::string> queries;
+    for (int i = 0; i < query_count; ++i) {
+        queries.push_back(MakeQuery(generator));
+    }
+    return queries;
+}
+
+std::vector<int> MakeRatings(std::mt19937& generator) {
+    std::vector<int> ratings(generator() % 4);
+    for (int& rating : ratings) {
+        rating = static_cast<int>(generator() % 21) - 10;
+    }
+    return ratings;
+}
+
+// Adds documents of every status to both, with ids above those in the index
+void AddRandomDocuments(SearchServer& server, ReferenceIndex& reference, std::mt19937& generator, int document_count) {
+    for (int i = 0; i < document_count; ++i) {
+        const int document_id = reference.GetNextId();
+        const std::string text = MakeText(generator);
+        const auto status = static_cast<DocumentStatus>(generator() % 4);
+        const std::vector<int> ratings = MakeRatings(generator);
+        server.AddDocument(document_id, text, status, ratings);
+        reference.Add(document_id, text, status, ratings);
+    }
+}
+
+void AssertSameDocuments(std::vector<Document> actual, std::vector<Document> expected) {
+    const auto by_id = [](const Document& lhs, const Document& rhs) {
+        return lhs.id < rhs.id;
+    };
+    std::sort(actual.begin(), actual.end(), by_id);
+    std::sort(expected.begin(), expected.end(), by_id);
+    ASSERT(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        ASSERT(actual[i].id == expected[i].id);
+        ASSERT(actual[i].rating == expected[i].rating);
+        ASSERT(std::abs(actual[i].relevance - expected[i].relevance) < 1e-9);
+    }
+}
+
+// The top documents must have the highest relevances of all matches; documents whose
+// relevances are within RELEVANCE_EPSILON may come in either order
+void AssertTopDocuments(const std::vector<Document>& actual, std::vector<Document> expected,
+                        size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT) {
+    std::sort(expected.begin(), expected.end(), [](const Document& lhs, const Document& rhs) {
+        return lhs.relevance > rhs.relevance;
+    });
+    ASSERT(actual.size() == std::min(expected.size(), max_document_count));
+    std::map<int, double> expected_relevances;
+    for (const Document& document : expected) {
+        expected_relevances.emplace(document.id, document.relevance);
+    }
+    for (size_t i = 0; i < actual.size(); ++i) {
+        ASSERT(std::abs(actual[i].relevance - expected[i].relevance) < 2 * RELEVANCE_EPSILON);
+        ASSERT(expected_relevances.count(actual[i].id) > 0);
+        ASSERT(std::abs(actual[i].relevance - expected_relevances.at(actual[i].id)) < 1e-9);
+    }
+}
+
+// For results of the same evaluation, which must not differ even in the order of ties
+void AssertIdenticalDocuments(const std::vector<Document>& actual, const std::vector<Document>& expected) {
+    ASSERT(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        ASSERT(actual[i].id == expected[i].id);
+        ASSERT(actual[i].relevance == expected[i].relevance);
+        ASSERT(actual[i].rating == expected[i].rating);
+    }
+}
+
+// The predicates FindTopDocuments recognizes must find what the same test written as a plain callable finds
+void AssertSamePredicates(const SearchServer& server, const ReferenceIndex& reference, const std::string& query, std::mt19937& generator) {
+    const int min_rating = static_cast<int>(generator() % 16) - 10;
+    const int max_rating = min_rating + static_cast<int>(generator() % 8);
+    const auto rating_between = [min_rating, max_rating](int, DocumentStatus, int rating) {
+        return min_rating <= rating && rating <= max_rating;
+    };
+    AssertSameDocuments(server.FindTopDocuments(query, RatingBetween{min_rating, max_rating}, ALL_DOCUMENTS),
+                        server.FindTopDocuments(query, rating_between, ALL_DOCUMENTS));
+    AssertSameDocuments(server.FindTopDocuments(std::execution::par, query, RatingBetween{min_rating, max_rating}, ALL_DOCUMENTS),
+                        reference.FindAll(query, rating_between));
+    AssertTopDocuments(server.FindTopDocuments(query, RatingBetween{min_rating, max_rating}), reference.FindAll(query, rating_between));
+
+    // Some of the ids are repeated, removed or were never added
+    std::vector<int> document_ids;
+    for (int i = 0; i < 40; ++i) {
+        document_ids.push_back(static_cast<int>(generator() % (reference.GetNextId() + 10)));
+    }
+    const std::set<int> id_set(document_ids.begin(), document_ids.end());
+    const auto document_id_in = [&id_set](int document_id, DocumentStatus, int) {
+        return id_set.count(document_id) > 0;
+    };
+    AssertSameDocuments(server.FindTopDocuments(query, DocumentIdIn{document_ids}, ALL_DOCUMENTS),
+                        server.FindTopDocuments(query, document_id_in, ALL_DOCUMENTS));
+    AssertSameDocuments(server.FindTopDocuments(std::execution::par, query, DocumentIdIn{document_ids}, ALL_DOCUMENTS),
+                        reference.FindAll(query, document_id_in));
+    AssertTopDocuments(server.FindTopDocuments(query, DocumentIdIn{document_ids}), reference.FindAll(query, document_id_in));
+    AssertSameDocuments(server.FindTopDocuments(query, RatingBetween{min_rating, max_rating}, ALL_DOCUMENTS, QueryMode::ALL_WORDS),
+                        reference.FindAll(query, rating_between, QueryMode::ALL_WORDS));
+    AssertSameDocuments(server.FindTopDocuments(query, DocumentIdIn{document_ids}, ALL_DOCUMENTS, QueryMode::ALL_WORDS),
+                        reference.FindAll(query, document_id_in, QueryMode::ALL_WORDS));
+}
+
+// A batch must answer every query, repeated or not, as FindTopDocuments does on its own
+void AssertSameBatches(const SearchServer& server, const ReferenceIndex& reference, std::mt19937& generator) {
+    std::vector<std::string> queries;
+    for (int i = 0; i < 12; ++i) {
+        queries.push_back(i % 4 == 3 ? queries[i - 2] : MakeQuery(generator));
+    }
+    for (const DocumentStatus status : DOCUMENT_STATUSES) {
+        const auto all_documents = server.FindTopDocumentsBatch(queries.begin(), queries.end(), status, ALL_DOCUMENTS);
+        const auto top_documents = server.FindTopDocumentsBatch(queries.begin(), queries.end(), status);
+        ASSERT(all_documents.size() == queries.size() && top_documents.size() == queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            AssertSameDocuments(all_documents[i], server.FindTopDocuments(queries[i], status, ALL_DOCUMENTS));
+            AssertTopDocuments(top_documents[i], reference.FindAll(queries[i], status));
+        }
+    }
+    ASSERT(server.FindTopDocumentsBatch(queries.begin(), queries.begin()).empty());
+
+    ThreadPool thread_pool(2);
+    for (const auto& batched : {ProcessQueriesBatched(server, queries), ProcessQueriesBatched(server, queries, 5),
+                                ProcessQueriesBatched(thread_pool, server, queries, 5)}) {
+        ASSERT(batched.size() == queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            AssertTopDocuments(batched[i], reference.FindAll(queries[i], DocumentStatus::ACTUAL));
+        }
+    }
+}
+
+void AssertSameIndex(const SearchServer& server, const ReferenceIndex& reference, std::mt19937& generator) {
+    ASSERT(server.GetDocumentCount() == reference.GetDocumentCount());
+    for (int i = 0; i < 20; ++i) {
+        const std::string query = MakeQuery(generator);
+        AssertTopDocuments(server.FindTopDocuments(query), reference.FindAll(query, DocumentStatus::ACTUAL));
+        AssertTopDocuments(server.FindTopDocuments(std::execution::par, query), reference.FindAll(query, DocumentStatus::ACTUAL));
+        for (size_t max_document_count = 0; max_document_count <= 3; ++max_document_count) {
+            AssertTopDocuments(server.FindTopDocuments(query, DocumentStatus::ACTUAL, max_document_count),
+                               reference.FindAll(query, DocumentStatus::ACTUAL), max_document_count);
+            AssertTopDocuments(server.FindTopDocuments(std::execution::par, query, DocumentStatus::ACTUAL, max_document_count),
+                               reference.FindAll(query, DocumentStatus::ACTUAL), max_document_count);
+        }
+        for (const DocumentStatus status : DOCUMENT_STATUSES) {
+            AssertSameDocuments(server.FindTopDocuments(query, status, ALL_DOCUMENTS), reference.FindAll(query, status));
+            AssertSameDocuments(server.FindTopDocuments(query, status, ALL_DOCUMENTS, QueryMode::ALL_WORDS),
+                                reference.FindAll(query, status, QueryMode::ALL_WORDS));
+        }
+        // Any other callable makes the query scan every status partition
+        const auto even_not_banned = [](int document_id, DocumentStatus status, int) {
+            return document_id % 2 == 0 && status != DocumentStatus::BANNED;
+        };
+        AssertSameDocuments(server.FindTopDocuments(query, even_not_banned, ALL_DOCUMENTS), reference.FindAll(query, even_not_banned));
+        AssertSamePredicates(server, reference, query, generator);
+    }
+    // Frequent words have long posting lists, where pruning skips the most
+    for (const size_t max_document_count : {1, 10, 50}) {
+        const std::string query = "w0 w1 w2 "s + MakeWord(generator);
+        AssertTopDocuments(server.FindTopDocuments(query, DocumentStatus::ACTUAL, max_document_count),
+                           reference.FindAll(query, DocumentStatus::ACTUAL), max_document_count);
+    }
+    AssertSameBatches(server, reference, generator);
+    const std::string query = MakeQuery(generator);
+    for (const auto& [document_id, status] : reference.GetStatuses()) {
+        if (document_id % 7 != 0) {
+            continue;
+        }
+        const auto expected_freqs = reference.GetWordFrequencies(document_id);
+        const auto actual_freqs = server.GetWordFrequencies(document_id);
+        ASSERT(actual_freqs.size() == expected_freqs.size());
+        for (const auto& [word, freq] : expected_freqs) {
+            ASSERT(actual_freqs.count(word) > 0 && std::abs(actual_freqs.at(word) - freq) < 1e-12);
+        }
+        const std::vector<std::string> expected_words = reference.Match(query, document_id);
+        for (const auto& [words, actual_status] : {server.MatchDocument(query, document_id), server.MatchDocument(std::execution::par, query, document_id)}) {
+            ASSERT(std::vector<std::string>(words.begin(), words.end()) == expected_words);
+            ASSERT(actual_status == status);
+        }
+    }
+}
+
+void TestAgainstReference(IndexFormat index_format) {
+    const std::string snapshot_path = (std::filesystem::temp_directory_path() / "search_server_test.snap").string();
+    std::mt19937 generator(42);
+    std::optional<SearchServer> server;
+    server.emplace(STOP_WORDS, index_format);
+    ReferenceIndex reference;
+    int next_id = 0;
+    for (int step = 1; step <= 3000; ++step) {
+        const unsigned operation = generator() % 10;
+        if (operation < 5) {
+            const std::string text = MakeText(generator);
+            const auto status = static_cast<DocumentStatus>(generator() % 4);
+            const std::vector<int> ratings = MakeRatings(generator);
+            server->AddDocument(next_id, text, status, ratings);
+            reference.Add(next_id++, text, status, ratings);
+        } else if (operation == 5) {
+            // A batch goes in whole or not at all
+            std::vector<std::string> texts;
+            std::vector<DocumentToAdd> batch;
+            for (int i = 0; i < 20; ++i) {
+                texts.push_back(MakeText(generator));
+            }
+            for (int i = 0; i < 20; ++i) {
+                batch.push_back({next_id + i, texts[i], static_cast<DocumentStatus>(generator() % 4), MakeRatings(generator)});
+            }
+            if (generator() % 4 == 0) {
+                batch.back().id = batch.front().id;
+                ASSERT_THROWS(server->AddDocuments(std::execution::par, batch), std::invalid_argument);
+                continue;
+            }
+            server->AddDocuments(std::execution::par, batch);
+            for (const DocumentToAdd& document : batch) {
+                reference.Add(document.id, document.text, document.status, document.ratings);
+            }
+            next_id += 20;
+        } else {
+            const int document_id = static_cast<int>(generator() % (next_id + 1));
+            if (operation % 2 == 0) {
+                server->RemoveDocument(document_id);
+            } else {
+                server->RemoveDocument(std::execution::par, document_id);
+            }
+            reference.Remove(document_id);
+        }
+
+        if (step % 1200 == 0) {
+            // Enough removed slots to renumber the documents
+            for (int document_id = 0; document_id < next_id; document_id += 2) {
+                server->RemoveDocument(document_id);
+                reference.Remove(document_id);
+            }
+        }
+        if (step % 250 == 0) {
+            AssertSameIndex(*server, reference, generator);
+        }
+        if (step % 1000 == 0) {
+            // The opened server reads the snapshot in place and goes on changing from there
+            server->SaveSnapshot(snapshot_path);
+            server.emplace(SearchServer::OpenSnapshot(snapshot_path));
+            AssertSameIndex(*server, reference, generator);
+            const SearchServer copy(*server);
+            AssertSameIndex(copy, reference, generator);
+        }
+        if (step % 1500 == 0) {
+            SearchServer rebuilt(STOP_WORDS, index_format);
+            for (const int document_id : *server) {
+                rebuilt.AddDocument(*server, document_id);
+            }
+            AssertSameIndex(rebuilt, reference, generator);
+        }
+    }
+    std::filesystem::remove(snapshot_path);
+}
+
+void TestPlainIndex() {
+    TestAgainstReference(IndexFormat::PLAIN);
+}
+
+void TestCompressedIndex() {
+    TestAgainstReference(IndexFormat::COMPRESSED);
+}
+
+void TestInvalidInput() {
+    SearchServer server("and in"s);
+    server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, {1});
+    ASSERT_THROWS(server.AddDocument(1, "dog"s, DocumentStatus::ACTUAL, {1}), std::invalid_argument);
+    ASSERT_THROWS(server.AddDocument(-1, "dog"s, DocumentStatus::ACTUAL, {1}), std::invalid_argument);
+    ASSERT_THROWS(server.AddDocument(2, "dog\x12"s, DocumentStatus::ACTUAL, {1}), std::invalid_argument);
+    ASSERT_THROWS(SearchServer("and in\x01"s), std::invalid_argument);
+    ASSERT_THROWS(server.FindTopDocuments("--cat"s), std::invalid_argument);
+    ASSERT_THROWS(server.FindTopDocuments("cat -"s), std::invalid_argument);
+    ASSERT_THROWS(server.FindTopDocuments("cat\x01"s), std::invalid_argument);
+    ASSERT_THROWS(server.MatchDocument("cat --city"s, 1), std::invalid_argument);
+    // Extra spaces, stop words and unknown words change nothing
+    ASSERT(server.FindTopDocuments("  cat   city  "s).size() == 1);
+    ASSERT(server.FindTopDocuments("in and"s).empty());
+    ASSERT(server.FindTopDocuments("cat dog -mouse"s).size() == 1);
+    ASSERT(server.FindTopDocuments(""s).empty());
+    ASSERT(server.GetDocumentCount() == 1);
+}
+
+// A copy owns its words, so it keeps working once the server it was copied from is gone
+void TestCopiedServer() {
+    std::mt19937 generator(7);
+    std::optional<SearchServer> server;
+    server.emplace(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(*server, reference, generator, 500);
+    const SearchServer copy(*server);
+    server.reset();
+    AssertSameIndex(copy, reference, generator);
+}
+
+// Whichever allocation of an add fails, the server must be left as it was before the add
+void TestFailedAddsChangeNothing() {
+    for (const IndexFormat index_format : {IndexFormat::PLAIN, IndexFormat::COMPRESSED}) {
+        std::mt19937 generator(8);
+        SearchServer server(STOP_WORDS, index_format);
+        ReferenceIndex reference;
+        AddRandomDocuments(server, reference, generator, 300);
+        for (long allocation_count = 0;; ++allocation_count) {
+            const int document_id = reference.GetNextId();
+            // New words need new posting lists and existing ones grow
+            const std::string text = MakeText(generator) + " new"s + std::to_string(allocation_count) + " " + MakeText(generator);
+            const auto status = static_cast<DocumentStatus>(generator() % 4);
+            allocations_until_failure = allocation_count;
+            try {
+                server.AddDocument(document_id, text, status, {1});
+            } catch (const std::bad_alloc&) {
+                allocations_until_failure = -1;
+                AssertSameIndex(server, reference, generator);
+                continue;
+            }
+            allocations_until_failure = -1;
+            reference.Add(document_id, text, status, {1});
+            AssertSameIndex(server, reference, generator);
+            break;
+        }
+
+        for (long allocation_count = 0;; ++allocation_count) {
+            std::vector<std::string> texts;
+            std::vector<DocumentToAdd> batch;
+            for (int i = 0; i < 10; ++i) {
+                texts.push_back(MakeText(generator) + " batch"s + std::to_string(allocation_count));
+            }
+            for (int i = 0; i < 10; ++i) {
+                batch.push_back({reference.GetNextId() + i, texts[i], static_cast<DocumentStatus>(generator() % 4), MakeRatings(generator)});
+            }
+            allocations_until_failure = allocation_count;
+            try {
+                server.AddDocuments(std::execution::seq, batch);
+            } catch (const std::bad_alloc&) {
+                allocations_until_failure = -1;
+                if (allocation_count % 10 == 0) {
+                    AssertSameIndex(server, reference, generator);
+                }
+                ASSERT(server.GetDocumentCount() == reference.GetDocumentCount());
+                continue;
+            }
+            allocations_until_failure = -1;
+            for (const DocumentToAdd& document : batch) {
+                reference.Add(document.id, document.text, document.status, document.ratings);
+            }
+            AssertSameIndex(server, reference, generator);
+            break;
+        }
+    }
+}
+
+// Every added or removed document changes the IDF of every word, so no cached value may outlive a change
+void TestInverseDocumentFreqsFollowChanges() {
+    std::mt19937 generator(11);
+    SearchServer server(STOP_WORDS);
+    ReferenceIndex reference;
+    const std::string query = "w0 w1 w5 w30 -w9"s;
+    for (int step = 0; step < 300; ++step) {
+        if (step % 3 == 2) {
+            const int document_id = static_cast<int>(generator() % reference.GetNextId());
+            server.RemoveDocument(document_id);
+            reference.Remove(document_id);
+        } else {
+            AddRandomDocuments(server, reference, generator, 1);
+        }
+        AssertTopDocuments(server.FindTopDocuments(query), reference.FindAll(query, DocumentStatus::ACTUAL));
+        AssertSameDocuments(server.FindTopDocuments(query, DocumentStatus::BANNED, ALL_DOCUMENTS), reference.FindAll(query, DocumentStatus::BANNED));
+    }
+}
+
+// Every thread has a scratch arena of its own, so queries from several threads at once must
+// give what they give one at a time, even those that do not fit the arena
+void TestConcurrentQueries() {
+    std::mt19937 generator(15);
+    SearchServer server(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(server, reference, generator, 2000);
+    std::vector<std::string> queries = MakeQueries(generator, 100);
+    std::string long_query;
+    for (int i = 0; i < 20000; ++i) {
+        long_query += MakeWord(generator) + (i % 3 == 0 ? " -w"s + std::to_string(VOCABULARY_SIZE + i) + " "s : " "s);
+    }
+    queries.push_back(long_query);
+    AssertTopDocuments(server.FindTopDocuments(long_query), reference.FindAll(long_query, DocumentStatus::ACTUAL));
+
+    std::vector<std::vector<Document>> expected;
+    for (const std::string& query : queries) {
+        expected.push_back(server.FindTopDocuments(query));
+    }
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < 4; ++thread) {
+        threads.emplace_back([&] {
+            for (int round = 0; round < 3; ++round) {
+                for (size_t i = 0; i < queries.size(); ++i) {
+                    AssertIdenticalDocuments(server.FindTopDocuments(queries[i]), expected[i]);
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void TestThreadPool() {
+    for (const size_t worker_count : {0, 1, 3}) {
+        ThreadPool thread_pool(worker_count);
+        for (const size_t count : {0, 1, 7, 1000}) {
+            for (const size_t chunk_size : {0, 1, 8, 5000}) {
+                std::vector<std::atomic<int>> calls(count);
+                thread_pool.ParallelFor(count, chunk_size, [&calls](size_t i) {
+                    ++calls[i];
+                });
+                ASSERT(std::all_of(calls.begin(), calls.end(), [](const std::atomic<int>& call_count) {
+                    return call_count == 1;
+                }));
+            }
+        }
+        ASSERT_THROWS(thread_pool.ParallelFor(100, 1, [](size_t i) {
+            if (i == 42) {
+                throw std::out_of_range("42");
+            }
+        }), std::out_of_range);
+    }
+
+    // Queued tasks still run when the pool is destroyed
+    std::atomic<int> task_count = 0;
+    {
+        ThreadPool thread_pool(2);
+        for (int i = 0; i < 100; ++i) {
+            thread_pool.Submit([&task_count] {
+                ++task_count;
+            });
+        }
+    }
+    ASSERT(task_count == 100);
+
+    std::mt19937 generator(16);
+    SearchServer server(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(server, reference, generator, 1000);
+    const std::vector<std::string> queries = MakeQueries(generator, 300);
+    ThreadPool thread_pool(3);
+    const auto parallel = ProcessQueries(server, queries);
+    for (const auto& pooled : {ProcessQueries(thread_pool, server, queries), ProcessQueries(thread_pool, server, queries, 1)}) {
+        ASSERT(pooled.size() == queries.size() && parallel.size() == queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const std::vector<Document> expected = server.FindTopDocuments(queries[i]);
+            AssertIdenticalDocuments(pooled[i], expected);
+            AssertIdenticalDocuments(parallel[i], expected);
+        }
+    }
+}
+
+// The joined results are the documents of every query in query order
+void TestJoinedQueries() {
+    std::mt19937 generator(18);
+    SearchServer server(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(server, reference, generator, 1000);
+    const std::vector<std::string> queries = MakeQueries(generator, 500);
+    std::vector<Document> expected;
+    for (const std::string& query : queries) {
+        for (const Document& document : server.FindTopDocuments(query)) {
+            expected.push_back(document);
+        }
+    }
+
+    ThreadPool thread_pool(3);
+    // The joined vector is allocated at its exact size
+    const std::vector<Document> joined = ProcessQueriesJoined(server, queries);
+    AssertIdenticalDocuments(joined, expected);
+    ASSERT(joined.capacity() == joined.size());
+    const std::vector<Document> pool_joined = ProcessQueriesJoined(thread_pool, server, queries);
+    AssertIdenticalDocuments(pool_joined, expected);
+    ASSERT(pool_joined.capacity() == pool_joined.size());
+    AssertIdenticalDocuments(ProcessQueriesJoined(thread_pool, server, queries, 1), expected);
+    ASSERT(ProcessQueriesJoined(server, {}).empty());
+    for (const size_t window_size : {1, 7, 1024}) {
+        std::vector<Document> streamed;
+        const auto sink = [&streamed](const Document& document) {
+            streamed.push_back(document);
+        };
+        StreamQueriesJoined(server, queries, sink, window_size);
+        AssertIdenticalDocuments(streamed, expected);
+        streamed.clear();
+        StreamQueriesJoined(thread_pool, server, queries, sink, window_size);
+        AssertIdenticalDocuments(streamed, expected);
+    }
+}
+
+void TestAsyncQueries() {
+    std::mt19937 generator(19);
+    SearchServer server(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(server, reference, generator, 1000);
+    const std::vector<std::string> queries = MakeQueries(generator, 50);
+    std::vector<std::future<std::vector<Document>>> futures;
+    for (const std::string& query : queries) {
+        futures.push_back(server.FindTopDocumentsAsync(query));
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        AssertIdenticalDocuments(futures[i].get(), server.FindTopDocuments(queries[i]));
+    }
+
+    QueryLimits generous;
+    generous.deadline = std::chrono::steady_clock::now() + std::chrono::hours(1);
+    const DocumentIdIn document_id_in{{1, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377, 610, 987}};
+    const auto odd_rating = [](int, DocumentStatus, int rating) {
+        return rating % 2 != 0;
+    };
+    for (size_t i = 0; i < 10; ++i) {
+        const std::string& query = queries[i];
+        AssertIdenticalDocuments(server.FindTopDocumentsAsync(query, DocumentStatus::BANNED, 3).get(),
+                                 server.FindTopDocuments(query, DocumentStatus::BANNED, 3));
+        AssertIdenticalDocuments(server.FindTopDocumentsAsync(query, RatingBetween{-2, 5}).get(), server.FindTopDocuments(query, RatingBetween{-2, 5}));
+        AssertIdenticalDocuments(server.FindTopDocumentsAsync(query, document_id_in, ALL_DOCUMENTS, generous).get(),
+                                 server.FindTopDocuments(query, document_id_in, ALL_DOCUMENTS));
+        AssertIdenticalDocuments(server.FindTopDocumentsAsync(query, odd_rating, MAX_RESULT_DOCUMENT_COUNT, generous).get(),
+                                 server.FindTopDocuments(query, odd_rating));
+    }
+
+    // Queries abandoned before they start
+    QueryLimits cancelled;
+    cancelled.cancellation.Cancel();
+    QueryLimits expired;
+    expired.deadline = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+    for (const QueryLimits& limits : {cancelled, expired}) {
+        ASSERT_THROWS(server.FindTopDocumentsAsync(queries[0], DocumentStatus::ACTUAL, MAX_RESULT_DOCUMENT_COUNT, limits).get(), QueryAbandoned);
+        ASSERT_THROWS(server.FindTopDocumentsAsync(queries[0], document_id_in, MAX_RESULT_DOCUMENT_COUNT, limits).get(), QueryAbandoned);
+    }
+
+    // A query cancelled while it runs stops at its next check. Documents of equal relevance
+    // cannot be pruned, so the query visits every one of them
+    SearchServer uniform(STOP_WORDS);
+    for (int document_id = 0; document_id < static_cast<int>(4 * LIMIT_CHECK_INTERVAL); ++document_id) {
+        uniform.AddDocument(document_id, "cat city"s, DocumentStatus::ACTUAL, {1});
+    }
+    QueryLimits limits;
+    const CancellationToken cancellation = limits.cancellation;
+    const auto cancelling = [cancellation](int, DocumentStatus, int) {
+        cancellation.Cancel();
+        return true;
+    };
+    ASSERT_THROWS(uniform.FindTopDocumentsAsync("cat"s, cancelling, MAX_RESULT_DOCUMENT_COUNT, limits).get(), QueryAbandoned);
+
+    // A query over a set of ids checks its deadline while it looks them up, so one given a tenth
+    // of the time it takes cannot finish
+    std::vector<DocumentToAdd> more_documents;
+    DocumentIdIn all_ids;
+    for (int document_id = 0; document_id < static_cast<int>(64 * LIMIT_CHECK_INTERVAL); ++document_id) {
+        if (document_id >= static_cast<int>(4 * LIMIT_CHECK_INTERVAL)) {
+            more_documents.push_back({document_id, "cat city", DocumentStatus::ACTUAL, {1}});
+        }
+        all_ids.document_ids.push_back(document_id);
+    }
+    uniform.AddDocuments(std::execution::seq, more_documents);
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT(uniform.FindTopDocuments("cat city"s, all_ids).size() == MAX_RESULT_DOCUMENT_COUNT);
+    QueryLimits short_deadline;
+    short_deadline.deadline = std::chrono::steady_clock::now() + (std::chrono::steady_clock::now() - start) / 10;
+    ASSERT_THROWS(uniform.FindTopDocumentsAsync("cat city"s, all_ids, MAX_RESULT_DOCUMENT_COUNT, short_deadline).get(), QueryAbandoned);
+}
+
+// A cached result must be exactly what evaluating the query gives, before and after any change,
+// whether the cache keeps every query or keeps evicting them
+void TestQueryCache() {
+    std::mt19937 generator(20);
+    SearchServer uncached(STOP_WORDS);
+    ReferenceIndex reference;
+    AddRandomDocuments(uncached, reference, generator, 1000);
+    const std::vector<std::string> queries = MakeQueries(generator, 6);
+    for (const size_t capacity : {2, 64}) {
+        SearchServer cached(uncached);
+        cached.SetQueryCacheCapacity(capacity);
+        uint64_t lookup_count = 0;
+        for (int step = 0; step < 400; ++step) {
+            const std::string& query = queries[generator() % queries.size()];
+            if (step % 25 == 24) {
+                // The first lookup after a change must not be answered from the cache
+                AddRandomDocuments(uncached, reference, generator, 1);
+                cached.AddDocument(uncached, reference.GetNextId() - 1);
+                const QueryCacheStats before = cached.GetQueryCacheStats();
+                AssertIdenticalDocuments(cached.FindTopDocuments(query), uncached.FindTopDocuments(query));
+                ASSERT(cached.GetQueryCacheStats().misses == before.misses + 1);
+                ++lookup_count;
+                continue;
+            }
+            AssertIdenticalDocuments(cached.FindTopDocuments(query), uncached.FindTopDocuments(query));
+            AssertIdenticalDocuments(cached.FindTopDocuments(query, RatingBetween{-3, 3}), uncached.FindTopDocuments(query, RatingBetween{-3, 3}));
+            AssertIdenticalDocuments(cached.FindTopDocuments(query, DocumentStatus::BANNED, 2), uncached.FindTopDocuments(query, DocumentStatus::BANNED, 2));
+            lookup_count += 3;
+        }
+        const QueryCacheStats stats = cached.GetQueryCacheStats();
+        ASSERT(stats.hits + stats.misses == lookup_count);
+        ASSERT(capacity < queries.size() * 3 || stats.hits > stats.misses);
+
+        // Predicates without a cache key are always evaluated
+        const auto any_document = [](int, DocumentStatus, int) {
+            return true;
+        };
+        AssertIdenticalDocuments(cached.FindTopDocuments(queries[0], any_document), uncached.FindTopDocuments(queries[0], any_document));
+        ASSERT(cached.GetQueryCacheStats().hits + cached.GetQueryCacheStats().misses == lookup_count);
+    }
+}
+
+int main() {
+    RUN_TEST(TestPlainIndex);
+    RUN_TEST(TestCompressedIndex);
+    RUN_TEST(TestInvalidInput);
+    RUN_TEST(TestCopiedServer);
+    RUN_TEST(TestFailedAddsChangeNothing);
+    RUN_TEST(TestInverseDocumentFreqsFollowChanges);
+    RUN_TEST(TestConcurrentQueries);
+    RUN_TEST(TestThreadPool);
+    RUN_TEST(TestJoinedQueries);
+    RUN_TEST(TestAsyncQueries);
+    RUN_TEST(TestQueryCache);
+}
@@ -0,0 +1,351 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "search_server.h"
+#include "string_processing.h"
+
+// Documents the writable segment takes before it is sealed
+const size_t SEGMENT_DOCUMENT_COUNT = 4096;
+// Sealed segments of similar size merged into one at a time
+const size_t SEGMENT_MERGE_FACTOR = 4;
+// A sealed segment is rewritten once this share of its documents is removed
+const double SEGMENT_MAX_REMOVED_SHARE = 0.25;
+
+// Index split into segments, LSM-style. New documents go to a small writable segment, which is
+// sealed when full. A background thread merges sealed segments of similar size into larger ones,
+// so their number stays logarithmic in the document count. Removing a document from a sealed
+// segment only sets its tombstone bit; the document is dropped by the next merge of the segment.
+// Every segment computes IDF over the live documents of all segments, so a query fans out over
+// the segments and merges their top documents into the same result as one SearchServer gives.
+// Queries run concurrently with each other and with merges and wait only for a single
+// AddDocument or RemoveDocument
+class SegmentedSearchServer {
+public:
+    template <typename StringContainer>
+    explicit SegmentedSearchServer(const StringContainer& stop_words, IndexFormat index_format = IndexFormat::PLAIN)
+        : stop_words_(stop_words.begin(), stop_words.end())
+        , index_format_(index_format) {
+        segments_.push_back(MakeSegment());
+        merger_ = std::thread([this] {
+            MergeLoop();
+        });
+    }
+
+    explicit SegmentedSearchServer(const std::string& stop_words_text, IndexFormat index_format = IndexFormat::PLAIN)
+        : SegmentedSearchServer(SplitIntoWords(stop_words_text), index_format) {
+    }
+
+    SegmentedSearchServer(const SegmentedSearchServer&) = delete;
+    SegmentedSearchServer& operator=(const SegmentedSearchServer&) = delete;
+
+    ~SegmentedSearchServer() {
+        {
+            std::lock_guard lock(merge_mutex_);
+            stopping_ = true;
+        }
+        merge_wanted_.notify_one();
+        merger_.join();
+    }
+
+    void AddDocument(int document_id, std::string_view document, DocumentStatus status, const std::vector<int>& ratings) {
+        std::unique_lock lock(mutex_);
+        if (document_id < 0 || FindSegment(document_id) != nullptr) {
+            throw std::invalid_argument("Invalid document_id");
+        }
+        Segment& writable = *segments_.back();
+        writable.server.AddDocument(document_id, document, status, ratings);
+        writable.document_ids.insert(std::lower_bound(writable.document_ids.begin(), writable.document_ids.end(), document_id), document_id);
+        writable.removed.push_back(false);
+        statistics_.AddDocument(writable.server.GetWordFrequencies(document_id));
+        if (writable.document_ids.size() == SEGMENT_DOCUMENT_COUNT) {
+            segments_.push_back(MakeSegment());
+            lock.unlock();
+            WakeMerger();
+        }
+    }
+
+    void RemoveDocument(int document_id) {
+        std::unique_lock lock(mutex_);
+        Segment* segment = FindSegment(document_id);
+        if (segment == nullptr) {
+            return;
+        }
+        statistics_.RemoveDocument(segment->server.GetWordFrequencies(document_id));
+        const size_t position = segment->GetPosition(document_id);
+        if (segment == segments_.back().get()) {
+            segment->server.RemoveDocument(document_id);
+            segment->document_ids.erase(segment->document_ids.begin() + position);
+            segment->removed.erase(segment->removed.begin() + position);
+            return;
+        }
+        segment->removed[position] = true;
+        ++segment->removed_count;
+        if (segment->NeedsRewrite()) {
+            lock.unlock();
+            WakeMerger();
+        }
+    }
+
+    // Returns at most max_document_count documents, the most relevant first.
+    // The policy applies to the fan-out over the segments
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(ExecutionPolicy&& policy, std::string_view raw_query, DocumentPredicate document_predicate,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        std::shared_lock lock(mutex_);
+        std::vector<std::vector<Document>> segment_documents(segments_.size());
+        std::transform(policy, segments_.begin(), segments_.end(), segment_documents.begin(), [&](const std::shared_ptr<Segment>& segment) {
+            // Asking for as many more documents as are removed leaves enough once they are dropped
+            auto documents = segment->server.FindTopDocuments(std::execution::seq, raw_query, document_predicate,
+                                                              max_document_count + segment->removed_count, query_mode);
+            if (segment->removed_count > 0) {
+                documents.erase(std::remove_if(documents.begin(), documents.end(),
+                                               [&segment](const Document& document) {
+                                                   return segment->removed[segment->GetPosition(document.id)];
+                                               }),
+                                documents.end());
+            }
+            return documents;
+        });
+        lock.unlock();
+
+        std::vector<Document> result;
+        for (auto& documents : segment_documents) {
+            result.insert(result.end(), documents.begin(), documents.end());
+        }
+        const auto top_end = result.begin() + std::min(result.size(), max_document_count);
+        std::partial_sort(result.begin(), top_end, result.end(), [](const Document& lhs, const Document& rhs) {
+            if (std::abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON) {
+                return lhs.rating > rhs.rating;
+            }
+            return lhs.relevance > rhs.relevance;
+        });
+        result.erase(top_end, result.end());
+        return result;
+    }
+
+    template <typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(std::string_view raw_query, DocumentPredicate document_predicate,
+                                           size_t max_document_count = MAX_RESULT_DOCUMENT_COUNT, QueryMode query_mode = QueryMode::ANY_WORD) const {
+        return FindTopDocuments(std::execution::seq, raw_query, document_predicate, max_document_count, query_mode);
+    }
+
+    std::vector<Document> FindTopDocuments(std::string_view raw_query) const {
+        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    }
+
+    int GetDocumentCount() const {
+        std::shared_lock lock(mutex_);
+        return static_cast<int>(statistics_.GetDocumentCount());
+    }
+
+    // The writable segment included
+    size_t GetSegmentCount() const {
+        std::shared_lock lock(mutex_);
+        return segments_.size();
+    }
+
+private:
+    struct Segment {
+        SearchServer server;
+        // Sorted, with the tombstone bit of every document at the same position
+        std::vector<int> document_ids;
+        std::vector<bool> removed;
+        size_t removed_count = 0;
+
+        size_t GetPosition(int document_id) const {
+            return std::lower_bound(document_ids.begin(), document_ids.end(), document_id) - document_ids.begin();
+        }
+
+        bool Contains(int document_id) const {
+            const size_t position = GetPosition(document_id);
+            return position < document_ids.size() && document_ids[position] == document_id && !removed[position];
+        }
+
+        bool NeedsRewrite() const {
+            return removed_count > document_ids.size() * SEGMENT_MAX_REMOVED_SHARE;
+        }
+
+        size_t GetLiveDocumentCount() const {
+            return document_ids.size() - removed_count;
+        }
+    };
+
+    // Live documents of all segments. Changed only under the exclusive lock
+    class Statistics final : public CollectionStatistics {
+    public:
+        size_t GetDocumentCount() const override {
+            return document_count_;
+        }
+
+        size_t GetDocumentFreq(std::string_view word) const override {
+            const auto it = document_freqs_.find(word);
+            return it == document_freqs_.end() ? 0 : it->second;
+        }
+
+        uint64_t GetGeneration() const override {
+            return generation_;
+        }
+
+        void AddDocument(const std::map<std::string_view, double>& word_freqs) {
+            for (const auto& [word, _] : word_freqs) {
+                const auto it = document_freqs_.find(word);
+                if (it == document_freqs_.end()) {
+                    document_freqs_.emplace(word, 1);
+                } else {
+                    ++it->second;
+                }
+            }
+            ++document_count_;
+            ++generation_;
+        }
+
+        void RemoveDocument(const std::map<std::string_view, double>& word_freqs) {
+            for (const auto& [word, _] : word_freqs) {
+                const auto it = document_freqs_.find(word);
+                if (--it->second == 0) {
+                    document_freqs_.erase(it);
+                }
+            }
+            --document_count_;
+            ++generation_;
+        }
+
+    private:
+        std::map<std::string, size_t, std::less<>> document_freqs_;
+        size_t document_count_ = 0;
+        uint64_t generation_ = 1;
+    };
+
+    std::shared_ptr<Segment> MakeSegment() const {
+        auto segment = std::make_shared<Segment>(Segment{SearchServer(stop_words_, index_format_), {}, {}, 0});
+        segment->server.SetCollectionStatistics(&statistics_);
+        return segment;
+    }
+
+    Segment* FindSegment(int document_id) const {
+        for (const auto& segment : segments_) {
+            if (segment->Contains(document_id)) {
+                return segment.get();
+            }
+        }
+        return nullptr;
+    }
+
+    void WakeMerger() {
+        {
+            std::lock_guard lock(merge_mutex_);
+            merge_pending_ = true;
+        }
+        merge_wanted_.notify_one();
+    }
+
+    void MergeLoop() {
+        while (true) {
+            {
+                std::unique_lock lock(merge_mutex_);
+                merge_wanted_.wait(lock, [this] {
+                    return stopping_ || merge_pending_;
+                });
+                if (stopping_) {
+                    return;
+                }
+                merge_pending_ = false;
+            }
+            for (auto sources = PlanMerge(); !sources.empty(); sources = PlanMerge()) {
+                Merge(sources);
+                std::lock_guard lock(merge_mutex_);
+                if (stopping_) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // A sealed segment with too many removed documents, or else the first SEGMENT_MERGE_FACTOR
+    // sealed segments of one size tier, where a tier is SEGMENT_MERGE_FACTOR times larger than the one before
+    std::vector<std::shared_ptr<Segment>> PlanMerge() const {
+        std::shared_lock lock(mutex_);
+        const size_t sealed_count = segments_.size() - 1;
+        for (size_t i = 0; i < sealed_count; ++i) {
+            if (segments_[i]->NeedsRewrite()) {
+                return {segments_[i]};
+            }
+        }
+        std::map<size_t, std::vector<std::shared_ptr<Segment>>> tiers;
+        for (size_t i = 0; i < sealed_count; ++i) {
+            size_t tier = 0;
+            for (size_t size = segments_[i]->GetLiveDocumentCount() / SEGMENT_DOCUMENT_COUNT; size >= SEGMENT_MERGE_FACTOR; size /= SEGMENT_MERGE_FACTOR) {
+                ++tier;
+            }
+            auto& segments = tiers[tier];
+            segments.push_back(segments_[i]);
+            if (segments.size() == SEGMENT_MERGE_FACTOR) {
+                return segments;
+            }
+        }
+        return {};
+    }
+
+    // Builds the merged segment without holding the lock, then swaps it in
+    // together with the tombstones set in the meantime
+    void Merge(const std::vector<std::shared_ptr<Segment>>& sources) {
+        std::vector<std::vector<bool>> removed_before;
+        {
+            std::shared_lock lock(mutex_);
+            for (const auto& source : sources) {
+                removed_before.push_back(source->removed);
+            }
+        }
+
+        auto merged = MakeSegment();
+        for (size_t i = 0; i < sources.size(); ++i) {
+            for (size_t position = 0; position < sources[i]->document_ids.size(); ++position) {
+                if (!removed_before[i][position]) {
+                    merged->server.AddDocument(sources[i]->server, sources[i]->document_ids[position]);
+                    merged->document_ids.push_back(sources[i]->document_ids[position]);
+                }
+            }
+        }
+        std::sort(merged->document_ids.begin(), merged->document_ids.end());
+        merged->removed.assign(merged->document_ids.size(), false);
+
+        std::unique_lock lock(mutex_);
+        for (size_t i = 0; i < sources.size(); ++i) {
+            for (size_t position = 0; position < sources[i]->document_ids.size(); ++position) {
+                if (sources[i]->removed[position] && !removed_before[i][position]) {
+                    merged->removed[merged->GetPosition(sources[i]->document_ids[position])] = true;
+                    ++merged->removed_count;
+                }
+            }
+            segments_.erase(std::find(segments_.begin(), segments_.end(), sources[i]));
+        }
+        segments_.insert(segments_.begin(), std::move(merged));
+    }
+
+    const std::vector<std::string> stop_words_;
+    const IndexFormat index_format_;
+    // Guards the segments and the statistics. Sealed segments change only their tombstones
+    mutable std::shared_mutex mutex_;
+    Statistics statistics_;
+    // Sealed segments first, the writable segment last
+    std::vector<std::shared_ptr<Segment>> segments_;
+
+    std::mutex merge_mutex_;
+    std::condition_variable merge_wanted_;
+    bool merge_pending_ = false;
+    bool stopping_ = false;
+    std::thread merger_;
+};
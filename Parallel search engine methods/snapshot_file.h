@@ -0,0 +1,337 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_array.h"
+
+// Binary snapshots of a search index. A file is a fixed header followed by the payload:
+// plain values and arrays in the order they were written, every array prefixed with its
+// length and aligned to 8 bytes, so it can be used right where it lies in a mapping of the file.
+// Values are stored in the byte order of the machine, which the header records
+
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'R', 'C', 'H', 'S', 'N', 'A', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER_MARK = 0x01020304;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint64_t payload_size;
+    uint64_t checksum;
+};
+
+// The payload starts at this offset, so its arrays are as aligned as the mapping
+constexpr size_t SNAPSHOT_PAYLOAD_OFFSET = 64;
+constexpr size_t SNAPSHOT_ALIGNMENT = 8;
+
+// 64-bit hash of the payload, taken eight bytes at a time, so checking a large
+// snapshot costs little more than reading it
+class SnapshotChecksum {
+public:
+    void Update(const char* data, size_t size) {
+        size_ += size;
+        while (size > 0) {
+            const size_t taken = std::min(size, sizeof(pending_) - pending_size_);
+            std::memcpy(reinterpret_cast<char*>(&pending_) + pending_size_, data, taken);
+            pending_size_ += taken;
+            data += taken;
+            size -= taken;
+            if (pending_size_ == sizeof(pending_)) {
+                Mix(pending_);
+                pending_ = 0;
+                pending_size_ = 0;
+            }
+        }
+    }
+
+    uint64_t Finish() {
+        Mix(pending_);
+        Mix(size_);
+        return state_;
+    }
+
+private:
+    void Mix(uint64_t word) {
+        state_ ^= word;
+        state_ = (state_ << 29 | state_ >> 35) * 0x9E3779B97F4A7C15ull;
+    }
+
+    uint64_t state_ = 0xCBF29CE484222325ull;
+    uint64_t pending_ = 0;
+    size_t pending_size_ = 0;
+    uint64_t size_ = 0;
+};
+
+// Values go to the file byte for byte, so a type with padding would write whatever the padding
+// bytes happened to hold. Floating-point values have no padding; they are allowed even though
+// equal ones may differ in their bytes, like zeros of either sign
+template <typename T>
+constexpr bool IS_SNAPSHOT_VALUE = std::is_trivially_copyable_v<T>
+                                   && (std::has_unique_object_representations_v<T> || std::is_floating_point_v<T>);
+
+// Flushes a file or a directory to disk, so a rename into it survives a crash
+inline void SyncPath(const std::string& path) {
+    const int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    const bool synced = fsync(descriptor) == 0;
+    close(descriptor);
+    if (!synced) {
+        throw std::runtime_error("Cannot sync " + path);
+    }
+}
+
+// Writes a snapshot next to its path and renames it into place once it is complete and on
+// disk, so the path holds either the previous file or the whole new snapshot, even after a crash
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string& path)
+        : path_(path)
+        , temporary_path_(path + ".tmp")
+        , out_(temporary_path_, std::ios::binary | std::ios::trunc) {
+        if (!out_) {
+            throw std::runtime_error("Cannot create snapshot " + path);
+        }
+        const std::vector<char> header_space(SNAPSHOT_PAYLOAD_OFFSET, 0);
+        out_.write(header_space.data(), header_space.size());
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // An unfinished snapshot is removed
+    ~SnapshotWriter() {
+        if (!finished_) {
+            out_.close();
+            std::remove(temporary_path_.c_str());
+        }
+    }
+
+    template <typename T>
+    void Write(const T& value) {
+        static_assert(IS_SNAPSHOT_VALUE<T>);
+        WriteBytes(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    void WriteArray(const T* data, size_t size) {
+        static_assert(IS_SNAPSHOT_VALUE<T> && alignof(T) <= SNAPSHOT_ALIGNMENT);
+        Write(static_cast<uint64_t>(size));
+        Align();
+        WriteBytes(reinterpret_cast<const char*>(data), size * sizeof(T));
+        Align();
+    }
+
+    template <typename Array>
+    void WriteArray(const Array& array) {
+        WriteArray(array.data(), array.size());
+    }
+
+    // Strings go as one array of their characters and one of their end offsets
+    template <typename Strings>
+    void WriteStrings(const Strings& strings) {
+        std::vector<char> characters;
+        std::vector<uint64_t> ends;
+        for (const std::string_view string : strings) {
+            characters.insert(characters.end(), string.begin(), string.end());
+            ends.push_back(characters.size());
+        }
+        WriteArray(characters);
+        WriteArray(ends);
+    }
+
+    // Fills in the header, syncs the file and renames it to the path.
+    // The snapshot is complete only once this returns
+    void Finish() {
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byte_order_mark = SNAPSHOT_BYTE_ORDER_MARK;
+        header.payload_size = payload_size_;
+        header.checksum = checksum_.Finish();
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out_.close();
+        if (!out_) {
+            throw std::runtime_error("Cannot write snapshot " + path_);
+        }
+        SyncPath(temporary_path_);
+        std::filesystem::rename(temporary_path_, path_);
+        finished_ = true;
+        const std::string directory = std::filesystem::path(path_).parent_path().string();
+        SyncPath(directory.empty() ? "." : directory);
+    }
+
+private:
+    void WriteBytes(const char* data, size_t size) {
+        out_.write(data, size);
+        checksum_.Update(data, size);
+        payload_size_ += size;
+    }
+
+    void Align() {
+        static constexpr char ZEROS[SNAPSHOT_ALIGNMENT] = {};
+        WriteBytes(ZEROS, (SNAPSHOT_ALIGNMENT - payload_size_ % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT);
+    }
+
+    const std::string path_;
+    const std::string temporary_path_;
+    std::ofstream out_;
+    SnapshotChecksum checksum_;
+    uint64_t payload_size_ = 0;
+    bool finished_ = false;
+};
+
+// Read-only mapping of a whole file, unmapped when the last owner lets it go
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            throw std::runtime_error("Cannot open snapshot " + path);
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) != 0) {
+            close(descriptor);
+            throw std::runtime_error("Cannot open snapshot " + path);
+        }
+        size_ = static_cast<size_t>(status.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (data == MAP_FAILED) {
+                close(descriptor);
+                throw std::runtime_error("Cannot map snapshot " + path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        close(descriptor);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Reads a snapshot in the order it was written. Arrays are views of the mapping, which
+// the owner of the reader keeps alive for as long as they are used
+class SnapshotReader {
+public:
+    // Checks the header and the checksum of the whole payload
+    explicit SnapshotReader(const MappedFile& file)
+        : file_(file) {
+        SnapshotHeader header;
+        if (file.size() < SNAPSHOT_PAYLOAD_OFFSET) {
+            throw std::runtime_error("Snapshot is truncated");
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("File is not a snapshot");
+        }
+        if (header.version != SNAPSHOT_VERSION || header.byte_order_mark != SNAPSHOT_BYTE_ORDER_MARK) {
+            throw std::runtime_error("Snapshot version or byte order is not supported");
+        }
+        if (header.payload_size != file.size() - SNAPSHOT_PAYLOAD_OFFSET) {
+            throw std::runtime_error("Snapshot is truncated");
+        }
+        SnapshotChecksum checksum;
+        checksum.Update(file.data() + SNAPSHOT_PAYLOAD_OFFSET, header.payload_size);
+        if (checksum.Finish() != header.checksum) {
+            throw std::runtime_error("Snapshot checksum does not match");
+        }
+        position_ = SNAPSHOT_PAYLOAD_OFFSET;
+    }
+
+    template <typename T>
+    T Read() {
+        static_assert(IS_SNAPSHOT_VALUE<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    MappedArray<T> ReadArray() {
+        static_assert(IS_SNAPSHOT_VALUE<T>);
+        const uint64_t size = Read<uint64_t>();
+        Align();
+        if (size > (file_.size() - position_) / sizeof(T)) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        const T* data = reinterpret_cast<const T*>(Take(size * sizeof(T)));
+        Align();
+        return MappedArray<T>::View(data, size);
+    }
+
+    // Views of strings written by SnapshotWriter::WriteStrings
+    std::vector<std::string_view> ReadStrings() {
+        const MappedArray<char> characters = ReadArray<char>();
+        const MappedArray<uint64_t> ends = ReadArray<uint64_t>();
+        std::vector<std::string_view> strings;
+        strings.reserve(ends.size());
+        uint64_t begin = 0;
+        for (const uint64_t end : ends) {
+            if (end < begin || end > characters.size()) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+            strings.emplace_back(characters.data() + begin, end - begin);
+            begin = end;
+        }
+        return strings;
+    }
+
+    bool AtEnd() const {
+        return position_ == file_.size();
+    }
+
+private:
+    const char* Take(size_t size) {
+        if (size > file_.size() - position_) {
+            throw std::runtime_error("Snapshot is corrupted");
+        }
+        const char* data = file_.data() + position_;
+        position_ += size;
+        return data;
+    }
+
+    void Align() {
+        Take((SNAPSHOT_ALIGNMENT - position_ % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT);
+    }
+
+    const MappedFile& file_;
+    size_t position_ = 0;
+};
@@ -0,0 +1,125 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "search_server.h"
+
+// SearchServer that can be queried while documents are added or removed, without readers locking.
+// Two replicas of the index are kept. Readers pin the published one; a writer changes the other,
+// publishes it, waits for the readers still pinning the old replica to leave and then repeats
+// the change on it. Readers thus never wait for writers and always see a complete version,
+// for twice the memory and writing time. Writers wait for each other and for long-lived snapshots
+class SnapshotSearchServer {
+public:
+    // A pinned version of the index. Queries through it see no changes made after it was taken.
+    // Keep snapshots short: the next writer waits until they are released, and asynchronous
+    // queries started through one must be finished before it is released
+    class Snapshot {
+    public:
+        Snapshot(Snapshot&& other) noexcept
+            : server_(std::exchange(other.server_, nullptr))
+            , reader_count_(other.reader_count_) {
+        }
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot& operator=(Snapshot&&) = delete;
+
+        ~Snapshot() {
+            if (server_ != nullptr) {
+                reader_count_->fetch_sub(1);
+            }
+        }
+
+        const SearchServer& operator*() const {
+            return *server_;
+        }
+
+        const SearchServer* operator->() const {
+            return server_;
+        }
+
+    private:
+        friend class SnapshotSearchServer;
+
+        Snapshot(const SearchServer& server, std::atomic<size_t>& reader_count)
+            : server_(&server)
+            , reader_count_(&reader_count) {
+        }
+
+        const SearchServer* server_;
+        std::atomic<size_t>* reader_count_;
+    };
+
+    template <typename StringContainer>
+    explicit SnapshotSearchServer(const StringContainer& stop_words, IndexFormat index_format = IndexFormat::PLAIN)
+        : replicas_{SearchServer(stop_words, index_format), SearchServer(stop_words, index_format)} {
+    }
+
+    explicit SnapshotSearchServer(const std::string& stop_words_text, IndexFormat index_format = IndexFormat::PLAIN)
+        : replicas_{SearchServer(stop_words_text, index_format), SearchServer(stop_words_text, index_format)} {
+    }
+
+    SnapshotSearchServer(const SnapshotSearchServer&) = delete;
+    SnapshotSearchServer& operator=(const SnapshotSearchServer&) = delete;
+
+    Snapshot GetSnapshot() const {
+        while (true) {
+            const size_t replica = published_.load();
+            reader_counts_[replica].fetch_add(1);
+            // A writer that switched replicas in between may already be changing this one
+            if (published_.load() == replica) {
+                return Snapshot(replicas_[replica], reader_counts_[replica]);
+            }
+            reader_counts_[replica].fetch_sub(1);
+        }
+    }
+
+    template <typename... Args>
+    std::vector<Document> FindTopDocuments(Args&&... args) const {
+        return GetSnapshot()->FindTopDocuments(std::forward<Args>(args)...);
+    }
+
+    int GetDocumentCount() const {
+        return GetSnapshot()->GetDocumentCount();
+    }
+
+    void AddDocument(int document_id, std::string_view document, DocumentStatus status, const std::vector<int>& ratings) {
+        Write([&](SearchServer& server) {
+            server.AddDocument(document_id, document, status, ratings);
+        });
+    }
+
+    void RemoveDocument(int document_id) {
+        Write([&](SearchServer& server) {
+            server.RemoveDocument(document_id);
+        });
+    }
+
+private:
+    // A change that throws leaves the replica as it was, so the replicas never drift apart
+    template <typename Change>
+    void Write(Change change) {
+        std::lock_guard lock(write_mutex_);
+        const size_t old_replica = published_.load();
+        const size_t new_replica = 1 - old_replica;
+        change(replicas_[new_replica]);
+        published_.store(new_replica);
+        while (reader_counts_[old_replica].load() > 0) {
+            std::this_thread::yield();
+        }
+        change(replicas_[old_replica]);
+    }
+
+    std::array<SearchServer, 2> replicas_;
+    // Sequentially consistent, so a reader either sees the switch or is seen by the writer
+    std::atomic<size_t> published_{0};
+    mutable std::array<std::atomic<size_t>, 2> reader_counts_{};
+    std::mutex write_mutex_;
+};
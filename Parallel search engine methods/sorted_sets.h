@@ -0,0 +1,275 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SORTED_SETS_HAVE_SSSE3 1
+#endif
+
+// Set operations on sorted arrays of unique 32-bit values, such as the document indexes of
+// posting lists. Arrays of similar length are merged, on x86 four against four values at a
+// time when the CPU supports SSSE3. When one array is much shorter, its values are looked up
+// in the longer one by galloping instead.
+// Each function writes to result, which must have room for the size of lhs, and returns the
+// number of values written. Four-lane stores may write past the values returned, never past that
+
+// Galloping pays off once one side is this many times longer than the other
+constexpr size_t GALLOP_RATIO = 32;
+
+// First position at or after from whose value is not less than target: doubles the step
+// until it passes target, then searches the last step with lower_bound
+inline size_t GallopTo(const uint32_t* values, size_t from, size_t size, uint32_t target) {
+    size_t step = 1;
+    size_t low = from;
+    size_t high = from;
+    while (high < size && values[high] < target) {
+        low = high + 1;
+        high = from + step;
+        step *= 2;
+    }
+    return std::lower_bound(values + low, values + std::min(high, size), target) - values;
+}
+
+inline size_t IntersectSortedScalar(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size, uint32_t* result) {
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < lhs_size && j < rhs_size) {
+        if (lhs[i] < rhs[j]) {
+            ++i;
+        } else if (rhs[j] < lhs[i]) {
+            ++j;
+        } else {
+            result[count++] = lhs[i];
+            ++i;
+            ++j;
+        }
+    }
+    return count;
+}
+
+inline size_t SubtractSortedScalar(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size, uint32_t* result) {
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < lhs_size && j < rhs_size) {
+        if (lhs[i] < rhs[j]) {
+            result[count++] = lhs[i++];
+        } else if (rhs[j] < lhs[i]) {
+            ++j;
+        } else {
+            ++i;
+            ++j;
+        }
+    }
+    return std::copy(lhs + i, lhs + lhs_size, result + count) - result;
+}
+
+// Looks every value of the shorter side up in the longer side
+inline size_t IntersectSortedGalloping(const uint32_t* small, size_t small_size, const uint32_t* large, size_t large_size, uint32_t* result) {
+    size_t count = 0;
+    size_t position = 0;
+    for (size_t i = 0; i < small_size && position < large_size; ++i) {
+        position = GallopTo(large, position, large_size, small[i]);
+        if (position < large_size && large[position] == small[i]) {
+            result[count++] = small[i];
+        }
+    }
+    return count;
+}
+
+inline size_t SubtractSortedGalloping(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size, uint32_t* result) {
+    size_t count = 0;
+    if (lhs_size <= rhs_size) {
+        // Keep the values of lhs that are not found in rhs
+        size_t position = 0;
+        for (size_t i = 0; i < lhs_size; ++i) {
+            position = GallopTo(rhs, position, rhs_size, lhs[i]);
+            if (position == rhs_size || rhs[position] != lhs[i]) {
+                result[count++] = lhs[i];
+            }
+        }
+        return count;
+    }
+    // Copy the runs of lhs between the values of rhs
+    size_t begin = 0;
+    for (size_t j = 0; j < rhs_size && begin < lhs_size; ++j) {
+        const size_t position = GallopTo(lhs, begin, lhs_size, rhs[j]);
+        count = std::copy(lhs + begin, lhs + position, result + count) - result;
+        begin = position < lhs_size && lhs[position] == rhs[j] ? position + 1 : position;
+    }
+    return std::copy(lhs + begin, lhs + lhs_size, result + count) - result;
+}
+
+#ifdef SORTED_SETS_HAVE_SSSE3
+
+// Byte shuffles that move the lanes selected by a 4-bit mask to the front of a vector
+struct LaneCompactTable {
+    std::array<std::array<uint8_t, 16>, 16> shuffles{};
+
+    constexpr LaneCompactTable() {
+        for (unsigned mask = 0; mask < 16; ++mask) {
+            unsigned out = 0;
+            for (unsigned lane = 0; lane < 4; ++lane) {
+                if (mask & (1u << lane)) {
+                    for (unsigned byte = 0; byte < 4; ++byte) {
+                        shuffles[mask][out * 4 + byte] = static_cast<uint8_t>(lane * 4 + byte);
+                    }
+                    ++out;
+                }
+            }
+            for (unsigned byte = out * 4; byte < 16; ++byte) {
+                shuffles[mask][byte] = 0x80;
+            }
+        }
+    }
+};
+
+inline constexpr LaneCompactTable LANE_COMPACT_TABLE{};
+
+// Mask of the lanes of lhs that are equal to some lane of rhs
+__attribute__((target("ssse3"))) inline unsigned MatchLanes(__m128i lhs, __m128i rhs) {
+    const __m128i rotated_1 = _mm_shuffle_epi32(rhs, _MM_SHUFFLE(0, 3, 2, 1));
+    const __m128i rotated_2 = _mm_shuffle_epi32(rhs, _MM_SHUFFLE(1, 0, 3, 2));
+    const __m128i rotated_3 = _mm_shuffle_epi32(rhs, _MM_SHUFFLE(2, 1, 0, 3));
+    const __m128i equal = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(lhs, rhs), _mm_cmpeq_epi32(lhs, rotated_1)),
+                                       _mm_or_si128(_mm_cmpeq_epi32(lhs, rotated_2), _mm_cmpeq_epi32(lhs, rotated_3)));
+    return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(equal)));
+}
+
+// Stores the selected lanes of values at result and returns their number.
+// All four lanes are written, so result needs room for four values
+__attribute__((target("ssse3"))) inline size_t StoreLanes(__m128i values, unsigned mask, uint32_t* result) {
+    const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(LANE_COMPACT_TABLE.shuffles[mask].data()));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(result), _mm_shuffle_epi8(values, shuffle));
+    return __builtin_popcount(mask);
+}
+
+// Compares four values of each side against each other per step and moves past the block
+// with the smaller last value. A block of lhs is stored once it is passed, with the lanes
+// matched in any block of rhs it met, so no more than the consumed part of lhs is written
+__attribute__((target("ssse3"))) inline size_t IntersectSortedSsse3(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size,
+                                                                   uint32_t* result) {
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    unsigned matched = 0;
+    while (i + 4 <= lhs_size && j + 4 <= rhs_size) {
+        const __m128i lhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+        const __m128i rhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + j));
+        matched |= MatchLanes(lhs_block, rhs_block);
+        const uint32_t lhs_last = lhs[i + 3];
+        const uint32_t rhs_last = rhs[j + 3];
+        if (lhs_last <= rhs_last) {
+            count += StoreLanes(lhs_block, matched, result + count);
+            matched = 0;
+            i += 4;
+        }
+        j += rhs_last <= lhs_last ? 4 : 0;
+    }
+    // The current block of lhs may have met values of rhs that are already behind j
+    for (unsigned lane = 0; matched != 0 && lane < 4; ++lane) {
+        if ((matched & (1u << lane)) || std::binary_search(rhs + j, rhs + rhs_size, lhs[i + lane])) {
+            result[count++] = lhs[i + lane];
+        }
+    }
+    if (matched != 0) {
+        i += 4;
+    }
+    return count + IntersectSortedScalar(lhs + i, lhs_size - i, rhs + j, rhs_size - j, result + count);
+}
+
+// Same walk as IntersectSortedSsse3, keeping the lanes that were not matched
+__attribute__((target("ssse3"))) inline size_t SubtractSortedSsse3(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size,
+                                                                  uint32_t* result) {
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    unsigned matched = 0;
+    while (i + 4 <= lhs_size && j + 4 <= rhs_size) {
+        const __m128i lhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+        const __m128i rhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + j));
+        matched |= MatchLanes(lhs_block, rhs_block);
+        const uint32_t lhs_last = lhs[i + 3];
+        const uint32_t rhs_last = rhs[j + 3];
+        if (lhs_last <= rhs_last) {
+            count += StoreLanes(lhs_block, ~matched & 0xF, result + count);
+            matched = 0;
+            i += 4;
+        }
+        j += rhs_last <= lhs_last ? 4 : 0;
+    }
+    // The current block of lhs may have met values of rhs that are already behind j
+    for (unsigned lane = 0; matched != 0 && lane < 4; ++lane) {
+        if (!(matched & (1u << lane)) && !std::binary_search(rhs + j, rhs + rhs_size, lhs[i + lane])) {
+            result[count++] = lhs[i + lane];
+        }
+    }
+    if (matched != 0) {
+        i += 4;
+    }
+    return count + SubtractSortedScalar(lhs + i, lhs_size - i, rhs + j, rhs_size - j, result + count);
+}
+
+#endif
+
+using SortedSetKernel = size_t (*)(const uint32_t*, size_t, const uint32_t*, size_t, uint32_t*);
+
+struct SortedSetKernels {
+    SortedSetKernel intersect;
+    SortedSetKernel subtract;
+};
+
+// Chosen once for the CPU the program runs on
+inline const SortedSetKernels& GetSortedSetKernels() {
+    static const SortedSetKernels kernels = [] {
+#ifdef SORTED_SETS_HAVE_SSSE3
+        if (__builtin_cpu_supports("ssse3")) {
+            return SortedSetKernels{&IntersectSortedSsse3, &SubtractSortedSsse3};
+        }
+#endif
+        return SortedSetKernels{&IntersectSortedScalar, &SubtractSortedScalar};
+    }();
+    return kernels;
+}
+
+inline size_t IntersectSorted(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size, uint32_t* result) {
+    if (lhs_size * GALLOP_RATIO < rhs_size) {
+        return IntersectSortedGalloping(lhs, lhs_size, rhs, rhs_size, result);
+    }
+    if (rhs_size * GALLOP_RATIO < lhs_size) {
+        return IntersectSortedGalloping(rhs, rhs_size, lhs, lhs_size, result);
+    }
+    return GetSortedSetKernels().intersect(lhs, lhs_size, rhs, rhs_size, result);
+}
+
+inline size_t SubtractSorted(const uint32_t* lhs, size_t lhs_size, const uint32_t* rhs, size_t rhs_size, uint32_t* result) {
+    if (lhs_size * GALLOP_RATIO < rhs_size || rhs_size * GALLOP_RATIO < lhs_size) {
+        return SubtractSortedGalloping(lhs, lhs_size, rhs, rhs_size, result);
+    }
+    return GetSortedSetKernels().subtract(lhs, lhs_size, rhs, rhs_size, result);
+}
+
+// Replaces values with the values that are also in other. The result is allocated like values
+template <typename Values, typename OtherValues>
+void IntersectSorted(Values& values, const OtherValues& other) {
+    Values result(values.size(), 0u, values.get_allocator());
+    result.resize(IntersectSorted(values.data(), values.size(), other.data(), other.size(), result.data()));
+    values = std::move(result);
+}
+
+// Removes from values the values that are in other
+template <typename Values, typename OtherValues>
+void SubtractSorted(Values& values, const OtherValues& other) {
+    if (other.empty()) {
+        return;
+    }
+    Values result(values.size(), 0u, values.get_allocator());
+    result.resize(SubtractSorted(values.data(), values.size(), other.data(), other.size(), result.data()));
+    values = std::move(result);
+}
@@ -0,0 +1,103 @@
+// Checks every sorted set kernel against std::set_intersection and std::set_difference on
+// random arrays of all kinds of sizes, overlaps and value ranges. The results go to buffers
+// of exactly the room the kernels may use, so a sanitizer catches any write past it.
+// g++ -std=c++17 -O1 -g -fsanitize=address,undefined sorted_sets_test.cpp -o sorted_sets_test
+#include "sorted_sets.h"
+#include "test_runner.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+struct NamedKernel {
+    std::string name;
+    SortedSetKernel kernel;
+};
+
+// Sorted unique values; a narrow range makes the arrays overlap a lot
+std::vector<uint32_t> MakeSortedSet(std::mt19937& generator, size_t size, uint32_t first, uint32_t range) {
+    std::vector<uint32_t> values;
+    for (size_t i = 0; i < size; ++i) {
+        values.push_back(first + static_cast<uint32_t>(generator() % range));
+    }
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    return values;
+}
+
+void AssertKernel(const NamedKernel& kernel, const std::vector<uint32_t>& lhs, const std::vector<uint32_t>& rhs,
+                  const std::vector<uint32_t>& expected) {
+    std::vector<uint32_t> result(lhs.size());
+    const size_t count = kernel.kernel(lhs.data(), lhs.size(), rhs.data(), rhs.size(), result.data());
+    result.resize(count);
+    if (result != expected) {
+        std::cerr << kernel.name << " failed on " << lhs.size() << " and " << rhs.size() << " values" << std::endl;
+    }
+    ASSERT(result == expected);
+}
+
+void TestKernels() {
+    std::vector<NamedKernel> intersect_kernels{
+        {"IntersectSortedScalar", &IntersectSortedScalar},
+        {"IntersectSorted", static_cast<SortedSetKernel>(&IntersectSorted)},
+    };
+    std::vector<NamedKernel> subtract_kernels{
+        {"SubtractSortedScalar", &SubtractSortedScalar},
+        {"SubtractSortedGalloping", &SubtractSortedGalloping},
+        {"SubtractSorted", static_cast<SortedSetKernel>(&SubtractSorted)},
+    };
+#ifdef SORTED_SETS_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        intersect_kernels.push_back({"IntersectSortedSsse3", &IntersectSortedSsse3});
+        subtract_kernels.push_back({"SubtractSortedSsse3", &SubtractSortedSsse3});
+    }
+#endif
+
+    std::mt19937 generator(2024);
+    const uint32_t max_value = std::numeric_limits<uint32_t>::max();
+    for (int round = 0; round < 20000; ++round) {
+        // Sizes from empty to a few blocks, sometimes far apart so galloping kicks in
+        const size_t lhs_size = generator() % (round % 10 == 0 ? 2000 : 40);
+        const size_t rhs_size = generator() % (round % 10 == 5 ? 2000 : 40);
+        const uint32_t range = 1 + static_cast<uint32_t>(generator() % (round % 3 == 0 ? 64 : 100000));
+        // Values near the top of the range catch signed comparisons
+        const uint32_t first = round % 4 == 0 ? max_value - range + 1 : static_cast<uint32_t>(generator() % 1000);
+        const std::vector<uint32_t> lhs = MakeSortedSet(generator, lhs_size, first, range);
+        const std::vector<uint32_t> rhs = MakeSortedSet(generator, rhs_size, first, range);
+
+        std::vector<uint32_t> intersection;
+        std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(intersection));
+        std::vector<uint32_t> difference;
+        std::set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(difference));
+
+        for (const NamedKernel& kernel : intersect_kernels) {
+            AssertKernel(kernel, lhs, rhs, intersection);
+        }
+        // Galloping walks the shorter side, which it takes first
+        if (lhs.size() <= rhs.size()) {
+            AssertKernel({"IntersectSortedGalloping", &IntersectSortedGalloping}, lhs, rhs, intersection);
+        }
+        for (const NamedKernel& kernel : subtract_kernels) {
+            AssertKernel(kernel, lhs, rhs, difference);
+        }
+    }
+}
+
+void TestVectorOverloads() {
+    std::vector<uint32_t> values{1, 3, 5, 7, 9, 11};
+    IntersectSorted(values, std::vector<uint32_t>{3, 4, 5, 11, 12});
+    ASSERT((values == std::vector<uint32_t>{3, 5, 11}));
+    SubtractSorted(values, std::vector<uint32_t>{5});
+    ASSERT((values == std::vector<uint32_t>{3, 11}));
+    SubtractSorted(values, std::vector<uint32_t>{});
+    ASSERT((values == std::vector<uint32_t>{3, 11}));
+}
+
+int main() {
+    RUN_TEST(TestKernels);
+    RUN_TEST(TestVectorOverloads);
+}
@@ -7,36 +7,40 @@
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 #include <queue>
 
-std::vector<std::string> SplitIntoWords(const std::string& text) {
-    std::vector<std::string> words;
-    std::string word;
-    for (const char c : text) {
-        if (c == ' ') {
-            if (!word.empty()) {
-                words.push_back(word);
-                word.clear();
-            }
-        } else {
-            word += c;
+// Calls action for every space-separated word of text; the words are views into text
+template <typename Action>
+void ForEachWord(std::string_view text, Action action) {
+    while (true) {
+        const auto word_begin = text.find_first_not_of(' ');
+        if (word_begin == std::string_view::npos) {
+            break;
         }
+        text.remove_prefix(word_begin);
+        const auto word_end = std::min(text.find(' '), text.size());
+        action(text.substr(0, word_end));
+        text.remove_prefix(word_end);
     }
-    if (!word.empty()) {
-        words.push_back(word);
-    }
+}
 
+std::vector<std::string_view> SplitIntoWords(std::string_view text) {
+    std::vector<std::string_view> words;
+    ForEachWord(text, [&words](std::string_view word) {
+        words.push_back(word);
+    });
     return words;
 }
 
 template <typename StringContainer>
-std::set<std::string> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
-    std::set<std::string> non_empty_strings;
-    for (const std::string& str : strings) {
+std::set<std::string, std::less<>> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
+    std::set<std::string, std::less<>> non_empty_strings;
+    for (const auto& str : strings) {
         if (!str.empty()) {
-            non_empty_strings.insert(str);
+            non_empty_strings.emplace(str);
         }
     }
     return non_empty_strings;
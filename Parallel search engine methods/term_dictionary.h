@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "snapshot_file.h"
+
+using TermId = uint32_t;
+
+// Stores every distinct term once and numbers the terms densely in order of appearance
+class TermDictionary {
+public:
+    static constexpr TermId NO_TERM = std::numeric_limits<TermId>::max();
+
+    TermDictionary() = default;
+
+    // Terms of the snapshot stay shared with it; the others are copied, so the views of the copy
+    // never point into the original
+    TermDictionary(const TermDictionary& other)
+        : terms_(other.terms_.begin(), other.terms_.begin() + other.snapshot_term_count_)
+        , snapshot_term_count_(other.snapshot_term_count_) {
+        ids_.reserve(other.terms_.size());
+        for (TermId id = 0; id < terms_.size(); ++id) {
+            ids_.emplace(terms_[id], id);
+        }
+        for (const std::string& term : other.owned_terms_) {
+            Intern(term);
+        }
+    }
+
+    TermDictionary& operator=(const TermDictionary& other) {
+        if (this != &other) {
+            *this = TermDictionary(other);
+        }
+        return *this;
+    }
+
+    TermDictionary(TermDictionary&&) = default;
+    TermDictionary& operator=(TermDictionary&&) = default;
+
+    TermId Find(std::string_view term) const {
+        const auto it = ids_.find(term);
+        return it == ids_.end() ? NO_TERM : it->second;
+    }
+
+    TermId Intern(std::string_view term) {
+        const auto it = ids_.find(term);
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        const TermId id = static_cast<TermId>(terms_.size());
+        // A deque never relocates its elements, so the views in terms_ and ids_ stay valid
+        terms_.push_back(owned_terms_.emplace_back(term));
+        ids_.emplace(terms_.back(), id);
+        return id;
+    }
+
+    std::string_view GetTerm(TermId id) const {
+        return terms_[id];
+    }
+
+    size_t size() const {
+        return terms_.size();
+    }
+
+    void Save(SnapshotWriter& writer) const {
+        writer.WriteStrings(terms_);
+    }
+
+    // The terms stay in the snapshot, which must outlive the dictionary
+    static TermDictionary Open(SnapshotReader& reader) {
+        TermDictionary dictionary;
+        dictionary.terms_ = reader.ReadStrings();
+        dictionary.snapshot_term_count_ = dictionary.terms_.size();
+        dictionary.ids_.reserve(dictionary.terms_.size());
+        for (TermId id = 0; id < dictionary.terms_.size(); ++id) {
+            if (!dictionary.ids_.emplace(dictionary.terms_[id], id).second) {
+                throw std::runtime_error("Snapshot is corrupted");
+            }
+        }
+        return dictionary;
+    }
+
+private:
+    // Terms not read from a snapshot; terms_ views these and the ones in the snapshot
+    std::deque<std::string> owned_terms_;
+    std::vector<std::string_view> terms_;
+    std::unordered_map<std::string_view, TermId> ids_;
+    // The first terms, which are the ones read from a snapshot
+    size_t snapshot_term_count_ = 0;
+};
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdlib>
+#include <iostream>
+
+// Checks for the tests next to the headers. A failed check prints where it failed and aborts,
+// so the failure is not missed under a sanitizer or a script either
+#define ASSERT(expression)                                                                               \
+    do {                                                                                                 \
+        if (!(expression)) {                                                                             \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": ASSERT(" #expression ") failed" << std::endl; \
+            std::abort();                                                                                \
+        }                                                                                                \
+    } while (false)
+
+#define ASSERT_THROWS(statement, exception) \
+    do {                                    \
+        bool thrown = false;                \
+        try {                               \
+            statement;                      \
+        } catch (const exception&) {        \
+            thrown = true;                  \
+        }                                   \
+        ASSERT(thrown && #exception);       \
+    } while (false)
+
+#define RUN_TEST(test)                            \
+    do {                                          \
+        test();                                   \
+        std::cerr << #test << " OK" << std::endl; \
+    } while (false)
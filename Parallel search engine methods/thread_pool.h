@@ -0,0 +1,179 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Long-lived pool of worker threads. Every worker has its own task queue; a worker that runs
+// out of tasks steals from the others, oldest first. The pool is meant to be created once and
+// passed to the functions that need it, so threads are not started per batch
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t worker_count = std::thread::hardware_concurrency()) {
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < worker_count; ++i) {
+            threads_.emplace_back([this, i] {
+                WorkerLoop(i);
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    size_t GetWorkerCount() const {
+        return workers_.size();
+    }
+
+    // Queues a task for the workers. A pool without workers runs it right away
+    void Submit(std::function<void()> task) {
+        if (workers_.empty()) {
+            task();
+            return;
+        }
+        Worker& worker = *workers_[next_worker_++ % workers_.size()];
+        {
+            std::lock_guard lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(sleep_mutex_);
+            ++pending_task_count_;
+        }
+        wake_.notify_one();
+    }
+
+    // Calls function(i) for every i in [0, count). Chunks of chunk_size indexes are claimed one by one
+    // by the calling thread and by as many workers as there are chunks to share, so a slow chunk does
+    // not hold up the others. A batch of a single chunk runs on the calling thread alone.
+    // Returns when every call has finished; the first exception thrown by a call is rethrown here
+    template <typename Function>
+    void ParallelFor(size_t count, size_t chunk_size, Function function) {
+        chunk_size = std::max<size_t>(chunk_size, 1);
+        const size_t chunk_count = (count + chunk_size - 1) / chunk_size;
+        if (chunk_count <= 1 || workers_.empty()) {
+            for (size_t i = 0; i < count; ++i) {
+                function(i);
+            }
+            return;
+        }
+
+        // Helpers may start after the batch is over, so they only hold on to the batch state
+        // and touch function only for the chunks they claim
+        auto batch = std::make_shared<Batch>();
+        const auto run_chunks = [batch, count, chunk_size, chunk_count, &function] {
+            for (size_t chunk = batch->next_chunk++; chunk < chunk_count; chunk = batch->next_chunk++) {
+                try {
+                    for (size_t i = chunk * chunk_size; i < std::min(count, (chunk + 1) * chunk_size); ++i) {
+                        function(i);
+                    }
+                } catch (...) {
+                    std::lock_guard lock(batch->mutex);
+                    if (!batch->error) {
+                        batch->error = std::current_exception();
+                    }
+                }
+                if (++batch->done_chunks == chunk_count) {
+                    std::lock_guard lock(batch->mutex);
+                    batch->done.notify_all();
+                }
+            }
+        };
+        for (size_t i = 0; i < std::min(workers_.size(), chunk_count - 1); ++i) {
+            Submit(run_chunks);
+        }
+        run_chunks();
+
+        std::unique_lock lock(batch->mutex);
+        batch->done.wait(lock, [&] {
+            return batch->done_chunks == chunk_count;
+        });
+        if (batch->error) {
+            std::rethrow_exception(batch->error);
+        }
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct Batch {
+        std::atomic<size_t> next_chunk{0};
+        std::atomic<size_t> done_chunks{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+    // Takes the newest task of the worker's own queue, or else the oldest task of another queue
+    bool TryTakeTask(size_t worker_index, std::function<void()>& task) {
+        for (size_t offset = 0; offset < workers_.size(); ++offset) {
+            Worker& worker = *workers_[(worker_index + offset) % workers_.size()];
+            std::lock_guard lock(worker.mutex);
+            if (worker.tasks.empty()) {
+                continue;
+            }
+            if (offset == 0) {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            } else {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(size_t worker_index) {
+        std::function<void()> task;
+        while (true) {
+            if (TryTakeTask(worker_index, task)) {
+                {
+                    std::lock_guard lock(sleep_mutex_);
+                    --pending_task_count_;
+                }
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock lock(sleep_mutex_);
+            wake_.wait(lock, [this] {
+                return stopping_ || pending_task_count_ > 0;
+            });
+            if (stopping_ && pending_task_count_ == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_worker_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    size_t pending_task_count_ = 0;
+    bool stopping_ = false;
+};
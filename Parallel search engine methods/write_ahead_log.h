@@ -0,0 +1,162 @@
+#pragma once
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "snapshot_file.h"
+
+struct LogRecordHeader {
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+// Append-only log of opaque records, each framed with its size and checksum.
+// Appending only buffers a record; Commit makes it durable. Concurrent commits are grouped:
+// the first committer writes out everything buffered so far and syncs it with a single fsync,
+// while the others wait for it and find their records already durable.
+// A crash may leave a torn record at the end, which Replay drops.
+// Once a write fails, the log takes no more records: nothing after a lost record may be durable
+class WriteAheadLog {
+public:
+    explicit WriteAheadLog(const std::string& path)
+        : path_(path)
+        , descriptor_(open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)) {
+        if (descriptor_ < 0) {
+            throw std::runtime_error("Cannot open log " + path);
+        }
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        close(descriptor_);
+    }
+
+    // Calls apply(payload) for every complete record in the order they were appended and cuts
+    // the log after the last of them. Must be called before anything is appended
+    template <typename Apply>
+    void Replay(Apply apply) {
+        const MappedFile file(path_);
+        size_t position = 0;
+        while (file.size() - position >= sizeof(LogRecordHeader)) {
+            LogRecordHeader header;
+            std::memcpy(&header, file.data() + position, sizeof(header));
+            if (header.size > file.size() - position - sizeof(header)) {
+                break;
+            }
+            const std::string_view payload(file.data() + position + sizeof(header), header.size);
+            if (GetChecksum(payload) != header.checksum) {
+                break;
+            }
+            apply(payload);
+            position += sizeof(header) + header.size;
+        }
+        if (position != file.size() && ftruncate(descriptor_, position) != 0) {
+            throw std::runtime_error("Cannot truncate log " + path_);
+        }
+        size_ = position;
+    }
+
+    // Returns the sequence number to commit the record with
+    uint64_t Append(std::string_view payload) {
+        const LogRecordHeader header{static_cast<uint32_t>(payload.size()), 0, GetChecksum(payload)};
+        std::lock_guard lock(mutex_);
+        if (failed_) {
+            throw std::runtime_error("Cannot write log " + path_);
+        }
+        pending_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        pending_.append(payload);
+        return ++appended_sequence_;
+    }
+
+    // Returns once the record with the sequence number and every record before it are on disk
+    void Commit(uint64_t sequence) {
+        std::unique_lock lock(mutex_);
+        while (durable_sequence_ < sequence) {
+            if (failed_) {
+                throw std::runtime_error("Cannot write log " + path_);
+            }
+            if (flushing_) {
+                flushed_.wait(lock);
+                continue;
+            }
+            // Lead a group commit of everything appended so far
+            flushing_ = true;
+            std::string batch = std::move(pending_);
+            pending_.clear();
+            const uint64_t batch_sequence = appended_sequence_;
+            lock.unlock();
+            const bool written = WriteAll(batch) && fdatasync(descriptor_) == 0;
+            lock.lock();
+            flushing_ = false;
+            if (written) {
+                durable_sequence_ = batch_sequence;
+                size_ += batch.size();
+            } else {
+                failed_ = true;
+            }
+            flushed_.notify_all();
+        }
+    }
+
+    // Commits every record appended so far
+    void Sync() {
+        uint64_t sequence;
+        {
+            std::lock_guard lock(mutex_);
+            sequence = appended_sequence_;
+        }
+        Commit(sequence);
+    }
+
+    // Bytes of committed records
+    size_t GetSize() const {
+        std::lock_guard lock(mutex_);
+        return size_;
+    }
+
+private:
+    static uint64_t GetChecksum(std::string_view payload) {
+        SnapshotChecksum checksum;
+        checksum.Update(payload.data(), payload.size());
+        return checksum.Finish();
+    }
+
+    bool WriteAll(std::string_view data) const {
+        while (!data.empty()) {
+            const ssize_t written = write(descriptor_, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+        return true;
+    }
+
+    const std::string path_;
+    const int descriptor_;
+    mutable std::mutex mutex_;
+    std::condition_variable flushed_;
+    // Records appended but not yet handed to a group commit
+    std::string pending_;
+    uint64_t appended_sequence_ = 0;
+    uint64_t durable_sequence_ = 0;
+    bool flushing_ = false;
+    bool failed_ = false;
+    size_t size_ = 0;
+};